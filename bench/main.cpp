@@ -0,0 +1,272 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "particle_gpu.h"
+
+// Interpolation time against particle sort interval and field layout on a
+// synthetic field.
+//
+// Usage: les-bench [particles] [grid] [steps] [interval...]
+//
+// The grid matches an LES run with maxnx = maxny = maxnz = grid, so the field
+// is (grid + 5) x (grid + 5) x (grid + 2). An interval of 0 never sorts. The
+// layout table runs every field layout unsorted and sorted every step.
+//
+// Usage: les-bench --kernels [particles] [grid] [reps] [warmup] [csv|json]
+//
+// Times each entry point on its own and writes one record per kernel. The
+// grid is either maxnx = maxny = maxnz or maxnx x maxny x maxnz, as in
+// 128x128x64, and defaults to that of parameters.F. Particles and bytes come
+// from the kernel timers (see ParticleTimersGet), so the bandwidth is counted
+// as in les-test and LES runs. Every kernel starts from freshly generated
+// particles.
+
+Parameters BenchParameters() {
+	Parameters params;
+	params.Evaporation = 1;
+	params.LinearInterpolation = 0;
+
+	params.rhoa = 1.1;
+	params.nuf = 1.537e-5;
+	params.Cpa = 1006.0;
+	params.Pra = 0.715;
+	params.Sc = 0.615;
+
+	params.rhow = 1000.0;
+	params.part_grav = 0.0;
+	params.Cpp = 4179.0;
+	params.Mw = 0.018015;
+	params.Ru = 8.3144;
+	params.Ms = 0.05844;
+	params.Sal = 34.0;
+	params.Gam = 7.28e-2;
+	params.Ion = 2.0;
+	params.Os = 1.093;
+
+	params.radius_mass = 40.0e-6;
+	return params;
+}
+
+// Synthetic field of an LES run with maxnx x maxny x maxnz, stored as
+// (maxnx + 5) x (maxny + 5) x (maxnz + 2)
+struct BenchField {
+	int nx, ny, nz;
+	double xl, yl, zl, dx, dy;
+	std::vector<double> z, zz;
+	std::vector<fieldSize> u, v, w, t, q;
+};
+
+BenchField BenchFieldMake(const int maxnx, const int maxny, const int maxnz) {
+	BenchField field;
+	field.nx = maxnx + 5;
+	field.ny = maxny + 5;
+	field.nz = maxnz + 2;
+	field.xl = 0.251327;
+	field.yl = 0.251327;
+	field.zl = 0.04;
+	field.dx = field.xl / maxnx;
+	field.dy = field.yl / maxny;
+	const int nx = field.nx, ny = field.ny, nz = field.nz;
+
+	// Stretched vertical grid clustered towards both walls
+	field.z.resize(nz);
+	field.zz.resize(nz);
+	for(int k = 0; k < nz; k++) {
+		field.z[k] = 0.5 * field.zl * (1.0 + tanh(2.2 * (2.0 * k / (nz - 1.0) - 1.0)) / tanh(2.2));
+	}
+	field.zz[0] = field.z[0];
+	for(int k = 1; k < nz; k++) {
+		field.zz[k] = 0.5 * (field.z[k] + field.z[k - 1]);
+	}
+
+	const size_t cells = (size_t)nx * ny * nz;
+	field.u.resize(cells);
+	field.v.resize(cells);
+	field.w.resize(cells);
+	field.t.resize(cells);
+	field.q.resize(cells);
+	for(int k = 0; k < nz; k++) {
+		for(int j = 0; j < ny; j++) {
+			for(int i = 0; i < nx; i++) {
+				const size_t index = i + (size_t)j * nx + (size_t)k * nx * ny;
+				const double x = 2.0 * M_PI * i / maxnx, y = 2.0 * M_PI * j / maxny, h = field.z[k] / field.zl;
+				field.u[index] = 1.0 + 0.1 * sin(x) * cos(y) * h;
+				field.v[index] = -0.1 * cos(x) * sin(y) * h;
+				field.w[index] = 0.01 * sin(x + y) * h * (1.0 - h);
+				field.t[index] = 300.0 + 0.5 * h;
+				field.q[index] = 0.01 + 0.001 * h;
+			}
+		}
+	}
+	return field;
+}
+
+void BenchFieldSet(GPU *gpu, BenchField *field) {
+	ParticleFieldSet(gpu, field->u.data(), field->v.data(), field->w.data(), field->t.data(), field->q.data());
+}
+
+GPU *BenchGPU(const int particles, BenchField *field, const int layout) {
+	Parameters params = BenchParameters();
+	GPU *gpu = NewGPU(particles, field->nx, field->ny, field->nz, field->xl, field->yl, field->zl, field->z.data(), field->zz.data(), &params);
+	ParticleSetFieldLayout(gpu, layout);
+	BenchFieldSet(gpu, field);
+	return gpu;
+}
+
+// Mean interpolation and sort time per step
+void BenchRun(GPU *gpu, const double dx, const double dy, const int interval, const int steps, double *interpolate, double *sort) {
+	// Start every run from the same generation ordered particles
+	ParticleGenerate(gpu, 1, 1, 1080, 300.0, 40.0e-6, 0.01);
+
+	*interpolate = 0.0;
+	*sort = 0.0;
+	for(int step = 0; step < steps; step++) {
+		if(interval > 0 && step % interval == 0) {
+			auto start = std::chrono::steady_clock::now();
+			ParticleSort(gpu, dx, dy);
+			*sort += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		ParticleInterpolate(gpu, dx, dy);
+		ParticleDownload(gpu);
+		*interpolate += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		ParticleAdvance(gpu, step + 1, 2, 1.0e-3);
+	}
+	*interpolate /= steps;
+	*sort /= steps;
+}
+
+// Kernels timed by --kernels, each run warmup times and then reps times
+enum { BENCH_FIELD, BENCH_LINEAR, BENCH_SIXTH, BENCH_STEP, BENCH_NONPERIODIC, BENCH_PERIODIC, BENCH_STATISTICS, BenchKernels };
+const char *BenchKernelNames[BenchKernels] = {"field_set", "interpolate_linear", "interpolate_sixth", "step", "nonperiodic", "periodic", "statistics"};
+const int BenchKernelTimers[BenchKernels] = {TIMER_FIELD, TIMER_INTERPOLATE, TIMER_INTERPOLATE, TIMER_STEP, TIMER_NONPERIODIC, TIMER_PERIODIC, TIMER_STATISTICS};
+
+void BenchKernelRun(GPU *gpu, BenchField *field, const int kernel, const int rep) {
+	switch(kernel) {
+		case BENCH_FIELD:
+			BenchFieldSet(gpu, field);
+			break;
+		case BENCH_LINEAR:
+		case BENCH_SIXTH:
+			ParticleInterpolate(gpu, field->dx, field->dy);
+			break;
+		case BENCH_STEP:
+			ParticleStep(gpu, rep / 3 + 1, rep % 3 + 1, 1.0e-3);
+			break;
+		case BENCH_NONPERIODIC:
+			ParticleUpdateNonPeriodic(gpu);
+			break;
+		case BENCH_PERIODIC:
+			ParticleUpdatePeriodic(gpu);
+			break;
+		case BENCH_STATISTICS:
+			ParticleCalculateStatistics(gpu, field->dx, field->dy);
+			break;
+	}
+}
+
+int BenchKernelsMain(int argc, char **argv) {
+	const int particles = argc > 1 ? atoi(argv[1]) : 1000000;
+	int maxnx = 128, maxny = 128, maxnz = 128;
+	if(argc > 2 && sscanf(argv[2], "%dx%dx%d", &maxnx, &maxny, &maxnz) == 1) {
+		maxny = maxnz = maxnx;
+	}
+	const int reps = argc > 3 ? atoi(argv[3]) : 20;
+	const int warmup = argc > 4 ? atoi(argv[4]) : 3;
+	const int json = argc > 5 && strcmp(argv[5], "json") == 0;
+	if(particles <= 0 || maxnx <= 0 || maxny <= 0 || maxnz <= 0 || reps <= 0 || warmup < 0) {
+		fprintf(stderr, "Usage: les-bench --kernels [particles] [grid] [reps] [warmup] [csv|json]\n");
+		return 1;
+	}
+
+	BenchField field = BenchFieldMake(maxnx, maxny, maxnz);
+	GPU *gpu = BenchGPU(particles, &field, FIELD_PLANAR);
+	ParticleTimersEnable(1);
+
+	if(json) {
+		printf("{\"particles\": %d, \"grid\": [%d, %d, %d], \"reps\": %d, \"warmup\": %d, \"kernels\": [", particles, field.nx, field.ny, field.nz, reps, warmup);
+	} else {
+		printf("kernel,particles,nx,ny,nz,reps,mean_s,min_s,max_s,particles_per_s,gb_per_s\n");
+	}
+
+	for(int kernel = 0; kernel < BenchKernels; kernel++) {
+		// The wall kernel moves particles outside this shallow domain, so no
+		// kernel sees the positions left by another
+		ParticleGenerate(gpu, 1, 1, 1080, 300.0, 40.0e-6, 0.01);
+		gpu->mParameters.LinearInterpolation = kernel == BENCH_LINEAR;
+		for(int rep = 0; rep < warmup; rep++) {
+			BenchKernelRun(gpu, &field, kernel, rep);
+		}
+
+		ParticleTimersReset();
+		for(int rep = 0; rep < reps; rep++) {
+			BenchKernelRun(gpu, &field, kernel, rep);
+		}
+
+		double values[TimerValues];
+		ParticleTimersGet(BenchKernelTimers[kernel], values);
+		const double total = values[1] > 0.0 ? values[1] : 1.0e-300;
+		const double mean = values[1] / values[0], rate = values[4] / total, bandwidth = values[5] / total * 1.0e-9;
+		if(json) {
+			printf("%s\n  {\"kernel\": \"%s\", \"mean_s\": %.9e, \"min_s\": %.9e, \"max_s\": %.9e, \"particles_per_s\": %.6e, \"gb_per_s\": %.6f}", kernel ? "," : "", BenchKernelNames[kernel], mean, values[2], values[3], rate, bandwidth);
+		} else {
+			printf("%s,%d,%d,%d,%d,%d,%.9e,%.9e,%.9e,%.6e,%.6f\n", BenchKernelNames[kernel], particles, field.nx, field.ny, field.nz, reps, mean, values[2], values[3], rate, bandwidth);
+		}
+	}
+	if(json) printf("\n]}\n");
+
+	free(gpu);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if(argc > 1 && strcmp(argv[1], "--kernels") == 0) {
+		return BenchKernelsMain(argc - 1, argv + 1);
+	}
+
+	const int particles = argc > 1 ? atoi(argv[1]) : 1000000;
+	const int grid = argc > 2 ? atoi(argv[2]) : 128;
+	const int steps = argc > 3 ? atoi(argv[3]) : 20;
+
+	std::vector<int> intervals;
+	for(int i = 4; i < argc; i++) {
+		intervals.push_back(atoi(argv[i]));
+	}
+	if(intervals.empty()) {
+		intervals = {0, 1, 2, 5, 10};
+	}
+
+	printf("# particles=%d grid=%d steps=%d\n", particles, grid, steps);
+	printf("%8s %14s %14s %14s\n", "interval", "interp_s/step", "sort_s/step", "total_s/step");
+
+	BenchField field = BenchFieldMake(grid, grid, grid);
+	const double dx = field.dx, dy = field.dy;
+	GPU *gpu = BenchGPU(particles, &field, FIELD_PLANAR);
+
+	for(size_t n = 0; n < intervals.size(); n++) {
+		double interpolate, sort;
+		BenchRun(gpu, dx, dy, intervals[n], steps, &interpolate, &sort);
+		printf("%8d %14.6f %14.6f %14.6f\n", intervals[n], interpolate, sort, interpolate + sort);
+	}
+	free(gpu);
+
+	const char *names[3] = {"planar", "interleaved", "bricked"};
+	printf("\n%12s %18s %18s\n", "layout", "unsorted_s/step", "sorted_s/step");
+	for(int layout = FIELD_PLANAR; layout <= FIELD_BRICKED; layout++) {
+		gpu = BenchGPU(particles, &field, layout);
+
+		double unsorted, sorted, sort;
+		BenchRun(gpu, dx, dy, 0, steps, &unsorted, &sort);
+		BenchRun(gpu, dx, dy, 1, steps, &sorted, &sort);
+		printf("%12s %18.6f %18.6f\n", names[layout], unsorted, sorted);
+		free(gpu);
+	}
+
+	return 0;
+}
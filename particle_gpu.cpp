@@ -1,11 +1,25 @@
 #include "particle_gpu.h"
 #include "assert.h"
 #include "stdio.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #ifndef BUILD_CUDA
 #include "stdlib.h"
@@ -14,16 +28,22 @@
 #include "curand_kernel.h"
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
 #ifndef BUILD_CUDA
 #define DEVICE
+#define HOST_DEVICE
 #define GLOBAL
 #define SHARED
 #define CONSTANT
 #else
 #define DEVICE __device__
+#define HOST_DEVICE __host__ __device__
 #define GLOBAL __global__
 #define CONSTANT __constant__
 #define SHARED __shared__
@@ -38,6 +58,43 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort =
 }
 #endif
 
+// Contiguous block of a host loop owned by the calling OpenMP thread
+void HostKernelRange(const int count, int *start, int *end) {
+#ifdef _OPENMP
+	const int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+	const int chunk = count / threads, remainder = count % threads;
+	*start = thread * chunk + MIN(thread, remainder);
+	*end = *start + chunk + (thread < remainder ? 1 : 0);
+#else
+	*start = 0;
+	*end = count;
+#endif
+}
+
+// Work partition for the calling thread. CUDA threads use a grid stride while
+// host threads each take one contiguous block so that every particle is owned
+// by exactly one thread and results do not depend on the thread count.
+DEVICE void GPUKernelRange(const int pcount, int *start, int *end, int *stride) {
+#ifdef BUILD_CUDA
+	*start = blockIdx.x * blockDim.x + threadIdx.x;
+	*end = pcount;
+	*stride = blockDim.x * gridDim.x;
+#else
+	HostKernelRange(pcount, start, end);
+	*stride = 1;
+#endif
+}
+
+// Number of host threads used for the particle kernels
+int HostThreads(const GPU *gpu) {
+#ifdef _OPENMP
+	if(gpu->ThreadCount > 0) return gpu->ThreadCount;
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
 extern "C" int gpudevices() {
 	int nDevices = 1;
 #ifdef BUILD_CUDA
@@ -50,9 +107,25 @@ extern "C" int gpudevices() {
 
 CONSTANT Parameters cParams;
 
-DEVICE void GPUFindXYNeighbours(const double dx, const double dy, const Particle *__restrict__ particles, int *__restrict__ neighbours) {
-	neighbours[0 * 6 + 2] = floor(particles[0].xp[0] / dx) + 1;
-	neighbours[1 * 6 + 2] = floor(particles[0].xp[1] / dy) + 1;
+// Returns the index of the highest level at or below position, or -1 when
+// position lies below every level.
+HOST_DEVICE int GPULevelLocate(const LevelLocator locator, const double *__restrict__ levels, const int count, const double position) {
+	const double scaled = floor((position - locator.Origin) * locator.Scale);
+	const int bin = MIN(MAX(scaled, 0.0), (double)(locator.Bins - 1));
+
+	int k = locator.Index[bin];
+	while(k >= 0 && levels[k] > position) {
+		k--;
+	}
+	while(k + 1 < count && levels[k + 1] <= position) {
+		k++;
+	}
+	return k;
+}
+
+DEVICE void GPUFindXYNeighbours(const double dx, const double dy, const double x, const double y, int *__restrict__ neighbours) {
+	neighbours[0 * 6 + 2] = floor(x / dx) + 1;
+	neighbours[1 * 6 + 2] = floor(y / dy) + 1;
 
 	neighbours[0 * 6 + 1] = neighbours[0 * 6 + 2] - 1;
 	neighbours[0 * 6 + 0] = neighbours[0 * 6 + 1] - 1;
@@ -67,8 +140,8 @@ DEVICE void GPUFindXYNeighbours(const double dx, const double dy, const Particle
 	neighbours[1 * 6 + 5] = neighbours[1 * 6 + 4] + 1;
 }
 
-GLOBAL void GGPUFindXYNeighbours(const double dx, const double dy, const Particle *__restrict__ particles, int *__restrict__ neighbours) {
-	GPUFindXYNeighbours(dx, dy, particles, neighbours);
+GLOBAL void GGPUFindXYNeighbours(const double dx, const double dy, const double x, const double y, int *__restrict__ neighbours) {
+	GPUFindXYNeighbours(dx, dy, x, y, neighbours);
 }
 
 int *ParticleFindXYNeighbours(const double dx, const double dy, const Particle *particle) {
@@ -78,136 +151,331 @@ int *ParticleFindXYNeighbours(const double dx, const double dy, const Particle *
 	int *dResult;
 	gpuErrchk(cudaMalloc((void **)&dResult, sizeof(int) * 12));
 
-	Particle *dParticle;
-	gpuErrchk(cudaMalloc((void **)&dParticle, sizeof(Particle) * 1));
-	gpuErrchk(cudaMemcpy(dParticle, particle, sizeof(Particle) * 1, cudaMemcpyHostToDevice));
-
-	GGPUFindXYNeighbours<<<1, 1>>>(dx, dy, dParticle, dResult);
+	GGPUFindXYNeighbours<<<1, 1>>>(dx, dy, particle->xp[0], particle->xp[1], dResult);
 	gpuErrchk(cudaPeekAtLastError());
 
 	gpuErrchk(cudaMemcpy(hResult, dResult, sizeof(int) * 12, cudaMemcpyDeviceToHost));
 #else
-	GPUFindXYNeighbours(dx, dy, particle, hResult);
+	GPUFindXYNeighbours(dx, dy, particle->xp[0], particle->xp[1], hResult);
 #endif
 	return hResult;
 }
 
-GLOBAL void GPUFieldInterpolateLinear(const int nx, const int ny, const double dx, const double dy, const int nnz, const double *__restrict__ z, const double *__restrict__ zz, const fieldSize *__restrict__ uext, const fieldSize *__restrict__ vext, const fieldSize *__restrict__ wext, const fieldSize *__restrict__ Text, const fieldSize *__restrict__ T2ext, const int pcount, Particle *__restrict__ particles) {
-	int index_start = 0, index_stride = 1;
-#ifdef BUILD_CUDA
-	index_start = blockIdx.x * blockDim.x + threadIdx.x;
-	index_stride = blockDim.x * gridDim.x;
-#endif
-
-	for(int idx = index_start; idx < pcount; idx += index_stride) {
+// Field Layouts
+//
+// The interpolation kernels read the five fields through a view that maps the
+// node (i, j, k) of the nx x ny x nz field to an element and returns each
+// component of that element. Every view returns the same values, so the
+// layout only changes which addresses one stencil touches:
+//   planar      - one array per field, x fastest (the LES layout)
+//   interleaved - the five components of each node stored together
+//   bricked     - one array per field made of 4x4x4 bricks
+struct PlanarFieldView {
+	const fieldSize *u, *v, *w, *T, *q;
+	int nx, ny;
+
+	HOST_DEVICE int Index(const int i, const int j, const int k) const { return i + j * nx + k * ny * nx; }
+	HOST_DEVICE double U(const int n) const { return u[n]; }
+	HOST_DEVICE double V(const int n) const { return v[n]; }
+	HOST_DEVICE double W(const int n) const { return w[n]; }
+	HOST_DEVICE double Temperature(const int n) const { return T[n]; }
+	HOST_DEVICE double Humidity(const int n) const { return q[n]; }
+};
+
+struct InterleavedFieldView {
+	const fieldSize *data;
+	int nx, ny;
+
+	HOST_DEVICE int Index(const int i, const int j, const int k) const { return (i + j * nx + k * ny * nx) * 5; }
+	HOST_DEVICE double U(const int n) const { return data[n + 0]; }
+	HOST_DEVICE double V(const int n) const { return data[n + 1]; }
+	HOST_DEVICE double W(const int n) const { return data[n + 2]; }
+	HOST_DEVICE double Temperature(const int n) const { return data[n + 3]; }
+	HOST_DEVICE double Humidity(const int n) const { return data[n + 4]; }
+};
+
+struct BrickedFieldView {
+	const fieldSize *u, *v, *w, *T, *q;
+	int bx, by;
+
+	HOST_DEVICE int Index(const int i, const int j, const int k) const {
+		const int brick = ((k / FieldBrick) * by + (j / FieldBrick)) * bx + (i / FieldBrick);
+		return brick * FieldBrick * FieldBrick * FieldBrick + ((k % FieldBrick) * FieldBrick + (j % FieldBrick)) * FieldBrick + (i % FieldBrick);
+	}
+	HOST_DEVICE double U(const int n) const { return u[n]; }
+	HOST_DEVICE double V(const int n) const { return v[n]; }
+	HOST_DEVICE double W(const int n) const { return w[n]; }
+	HOST_DEVICE double Temperature(const int n) const { return T[n]; }
+	HOST_DEVICE double Humidity(const int n) const { return q[n]; }
+};
+
+// Views of the field storage bound by FieldArrayBind. The interleaved view
+// only uses the first pointer.
+template <class View>
+View FieldViewMake(const int nx, const int ny, fieldSize *const *fields);
+
+template <>
+PlanarFieldView FieldViewMake<PlanarFieldView>(const int nx, const int ny, fieldSize *const *fields) {
+	PlanarFieldView retVal = {fields[0], fields[1], fields[2], fields[3], fields[4], nx, ny};
+	return retVal;
+}
 
-// Setup shared memory for Z and ZZ
-#ifdef BUILD_CUDA
-		extern SHARED double shared[];
+template <>
+InterleavedFieldView FieldViewMake<InterleavedFieldView>(const int nx, const int ny, fieldSize *const *fields) {
+	InterleavedFieldView retVal = {fields[0], nx, ny};
+	return retVal;
+}
 
-		double *dzu = shared, *dzw = &shared[nnz + 1];
-		if(threadIdx.x == 0) {
-			for(int i = 1; i < nnz; i++) {
-				dzu[i] = zz[i] - zz[i - 1];
-				dzw[i] = z[i] - z[i - 1];
-			}
-			dzu[0] = dzu[1];
-			dzw[0] = dzw[1];
+template <>
+BrickedFieldView FieldViewMake<BrickedFieldView>(const int nx, const int ny, fieldSize *const *fields) {
+	BrickedFieldView retVal = {fields[0], fields[1], fields[2], fields[3], fields[4], (nx + FieldBrick - 1) / FieldBrick, (ny + FieldBrick - 1) / FieldBrick};
+	return retVal;
+}
 
-			dzu[nnz] = dzu[nnz - 1];
-			dzw[nnz] = dzw[nnz - 1];
-		}
-		__syncthreads();
-#else
-		const double *zShared = z;
-		const double *zzShared = zz;
+// Spacing of nnz levels, padded at both ends to nnz + 1 entries
+DEVICE void GPULevelSpacing(const double *__restrict__ levels, const int nnz, double *__restrict__ spacing) {
+	for(int i = 1; i < nnz; i++) {
+		spacing[i] = levels[i] - levels[i - 1];
+	}
+	spacing[0] = spacing[1];
+	spacing[nnz] = spacing[nnz - 1];
+}
 
-		double dzu[nnz + 1], dzw[nnz + 1];
-		for(int i = 1; i < nnz; i++) {
-			dzu[i] = zz[i] - zz[i - 1];
-			dzw[i] = z[i] - z[i - 1];
+// Level located from the result of a previous search. The cached level and
+// its neighbours are checked first so that a particle that stays within one
+// cell of its last level never needs the full search.
+HOST_DEVICE int GPULevelTrack(const LevelLocator locator, const double *__restrict__ levels, const int count, const int cached, const double position) {
+	if(cached >= -1 && cached < count) {
+		const int candidates[3] = {cached, cached + 1, cached - 1};
+		for(int c = 0; c < 3; c++) {
+			const int k = candidates[c];
+			if(k < -1 || k >= count) continue;
+			if((k < 0 || levels[k] <= position) && (k + 1 >= count || position < levels[k + 1])) return k;
 		}
-		dzu[0] = dzu[1];
-		dzw[0] = dzw[1];
-
-		dzu[nnz] = dzu[nnz - 1];
-		dzw[nnz] = dzw[nnz - 1];
-#endif
+	}
+	return GPULevelLocate(locator, levels, count, position);
+}
 
-		const double xPos = particles[idx].xp[0];
-		const double yPos = particles[idx].xp[1];
-		const double zPos = particles[idx].xp[2];
+template <class View>
+DEVICE void GPUInterpolateLinear(const View field, const double dx, const double dy, const int nnz, const double *__restrict__ z, const double *__restrict__ zz, const double *__restrict__ dzu, const double *__restrict__ dzw, const LevelLocator zLocator, const LevelLocator zzLocator, const int cache, const int idx, ParticleArray particles) {
+	const double xPos = particles.xp[0][idx];
+	const double yPos = particles.xp[1][idx];
+	const double zPos = particles.xp[2][idx];
 
-		const int ipt = floor(xPos / dx) + 1;
-		const int jpt = floor(yPos / dy) + 1;
+	const int ipt = floor(xPos / dx) + 1;
+	const int jpt = floor(yPos / dy) + 1;
 
-		int kpt = 0, kwpt = 0;
-		for(int j = 0; j < nnz; j++) {
-			if(zz[j] < zPos) kpt = j;
-			if(z[j] < zPos) kwpt = j;
-		}
+	int kpt = GPULevelTrack(zzLocator, zz, nnz, cache ? particles.level[0][idx] : -2, zPos);
+	int kwpt = GPULevelTrack(zLocator, z, nnz, cache ? particles.level[1][idx] : -2, zPos);
+	particles.level[0][idx] = kpt;
+	particles.level[1][idx] = kwpt;
+	while(kpt >= 0 && zz[kpt] == zPos) kpt--;
+	while(kwpt >= 0 && z[kwpt] == zPos) kwpt--;
+	kpt = MIN(MAX(kpt, 0), nnz - 2);
+	kwpt = MIN(MAX(kwpt, 0), nnz - 2);
 
 
-		double xUF = 0.0, yUF = 0.0, zUF = 0.0;
-		double Tf = 0.0, qinf = 0.0;
+	double xUF = 0.0, yUF = 0.0, zUF = 0.0;
+	double Tf = 0.0, qinf = 0.0;
 
 #pragma unroll
-		for(int i = 0; i < 2; i++) {
+	for(int i = 0; i < 2; i++) {
 #pragma unroll
-			for(int j = 0; j < 2; j++) {
+		for(int j = 0; j < 2; j++) {
 #pragma unroll
-				for(int k = 0; k < 2; k++) {
-					const int ix = i + ipt;
-					const int iy = i + jpt;
-					const int izuv = k + kpt;
-					const int izw = k + kwpt;
-
-					const double xv = dx * (i + ipt - 1);
-					const double yv = dy * (j + jpt - 1);
-
-					const double wtx = 1.0 - (std::abs(xPos - xv) / dx);
-					const double wty = 1.0 - (std::abs(yPos - yv) / dy);
-					const double wtz = 1.0 - (std::abs(zPos - zz[izuv]) / dzu[kpt + 1]);
-					const double wtzw = 1.0 - (std::abs(zPos - z[izw]) / dzw[kwpt + 1]);
-					xUF += uext[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wtx * wty * wtz;
-					yUF += vext[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wtx * wty * wtz;
-					zUF += wext[(ix + 1) + (iy + 1) * nx + izw * ny * nx] * wtx * wty * wtzw;
-					Tf += Text[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wtx * wty * wtz;
-					qinf += T2ext[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wtx * wty * wtz;
-
-                                        if (kpt == 0){
-					xUF = uext[(ix + 1) + (iy + 1) * nx + 1 * ny * nx];
-					yUF = vext[(ix + 1) + (iy + 1) * nx + 1 * ny * nx];
-					Tf = Text[(ix + 1) + (iy + 1) * nx + 1 * ny * nx];
-					qinf = T2ext[(ix + 1) + (iy + 1) * nx + 1 * ny * nx];
-                                         }
-
-                                        if (kpt == nnz-2){
-					xUF = uext[(ix + 1) + (iy + 1) * nx + (nnz-2) * ny * nx];
-					yUF = vext[(ix + 1) + (iy + 1) * nx + (nnz-2) * ny * nx];
-					Tf = Text[(ix + 1) + (iy + 1) * nx + (nnz-2) * ny * nx];
-					qinf = T2ext[(ix + 1) + (iy + 1) * nx + (nnz-2) * ny * nx];
-                                         }
-				}
+			for(int k = 0; k < 2; k++) {
+				const int ix = i + ipt;
+				const int iy = i + jpt;
+				const int izuv = k + kpt;
+				const int izw = k + kwpt;
+
+				const double xv = dx * (i + ipt - 1);
+				const double yv = dy * (j + jpt - 1);
+
+				const double wtx = 1.0 - (std::abs(xPos - xv) / dx);
+				const double wty = 1.0 - (std::abs(yPos - yv) / dy);
+				const double wtz = 1.0 - (std::abs(zPos - zz[izuv]) / dzu[kpt + 1]);
+				const double wtzw = 1.0 - (std::abs(zPos - z[izw]) / dzw[kwpt + 1]);
+				const int nuv = field.Index(ix + 1, iy + 1, izuv);
+				const int nw = field.Index(ix + 1, iy + 1, izw);
+				xUF += field.U(nuv) * wtx * wty * wtz;
+				yUF += field.V(nuv) * wtx * wty * wtz;
+				zUF += field.W(nw) * wtx * wty * wtzw;
+				Tf += field.Temperature(nuv) * wtx * wty * wtz;
+				qinf += field.Humidity(nuv) * wtx * wty * wtz;
+
+                                if (kpt == 0){
+				const int nb = field.Index(ix + 1, iy + 1, 1);
+				xUF = field.U(nb);
+				yUF = field.V(nb);
+				Tf = field.Temperature(nb);
+				qinf = field.Humidity(nb);
+                                 }
+
+                                if (kpt == nnz-2){
+				const int nt = field.Index(ix + 1, iy + 1, nnz - 2);
+				xUF = field.U(nt);
+				yUF = field.V(nt);
+				Tf = field.Temperature(nt);
+				qinf = field.Humidity(nt);
+                                 }
 			}
 		}
-
-		particles[idx].uf[0] = xUF;
-		particles[idx].uf[1] = yUF;
-		particles[idx].uf[2] = zUF;
-		particles[idx].Tf = Tf;
-		particles[idx].qinf = qinf;
 	}
+
+	particles.uf[0][idx] = xUF;
+	particles.uf[1][idx] = yUF;
+	particles.uf[2][idx] = zUF;
+	particles.Tf[idx] = Tf;
+	particles.qinf[idx] = qinf;
 }
 
-GLOBAL void GPUFieldInterpolate(const int nx, const int ny, const double dx, const double dy, const int nnz, const double *__restrict__ z, const double *__restrict__ zz, const fieldSize *__restrict__ uext, const fieldSize *__restrict__ vext, const fieldSize *__restrict__ wext, const fieldSize *__restrict__ Text, const fieldSize *__restrict__ T2ext, const int pcount, Particle *__restrict__ particles) {
-	int index_start = 0, index_stride = 1;
+template <class View>
+GLOBAL void GPUFieldInterpolateLinear(const View field, const double dx, const double dy, const int nnz, const double *__restrict__ z, const double *__restrict__ zz, const LevelLocator zLocator, const LevelLocator zzLocator, const int cache, const int pcount, ParticleArray particles) {
+	int index_start, index_end, index_stride;
+	GPUKernelRange(pcount, &index_start, &index_end, &index_stride);
+
+// Setup shared memory for Z and ZZ
 #ifdef BUILD_CUDA
-	index_start = blockIdx.x * blockDim.x + threadIdx.x;
-	index_stride = blockDim.x * gridDim.x;
+	extern SHARED double shared[];
+
+	double *dzu = shared, *dzw = &shared[nnz + 1];
+	if(threadIdx.x == 0) {
+		GPULevelSpacing(zz, nnz, dzu);
+		GPULevelSpacing(z, nnz, dzw);
+	}
+	__syncthreads();
+#else
+	double dzu[nnz + 1], dzw[nnz + 1];
+	GPULevelSpacing(zz, nnz, dzu);
+	GPULevelSpacing(z, nnz, dzw);
 #endif
 
-	for(int idx = index_start; idx < pcount; idx += index_stride) {
+	for(int idx = index_start; idx < index_end; idx += index_stride) {
+		GPUInterpolateLinear(field, dx, dy, nnz, z, zz, dzu, dzw, zLocator, zzLocator, cache, idx, particles);
+	}
+}
+
+// Lagrange Interpolation
+//
+// The sixth order weights are evaluated in barycentric form: the weight of
+// node j is the product of the particle offsets from every other node times
+// the inverse of the product of the node spacings. The horizontal grid is
+// uniform so the inverse denominators reduce to the constants below when the
+// offsets are measured in cells, and the vertical denominators are tabulated
+// per level by LagrangeDenominatorsBuild.
+CONSTANT double cLagrangeUniform[6] = {-1.0 / 120.0, 1.0 / 24.0, -1.0 / 12.0, 1.0 / 12.0, -1.0 / 24.0, 1.0 / 120.0};
+
+// Offset of the inverse denominators of the nodes levels[first .. first + nodes)
+HOST_DEVICE int LagrangeDenominatorIndex(const int count, const int first, const int nodes) {
+	return ((nodes / 2 - 1) * count + first) * 6;
+}
+
+// Weights of six nodes from the particle offsets and inverse denominators.
+// Prefix and suffix products give every product that skips one node.
+HOST_DEVICE void GPULagrangeWeights(const double *__restrict__ offset, const double *__restrict__ inverse, double *__restrict__ weights) {
+	double left[6], right[6];
+	left[0] = 1.0;
+	for(int k = 1; k < 6; k++) {
+		left[k] = left[k - 1] * offset[k - 1];
+	}
+	right[5] = 1.0;
+	for(int k = 4; k >= 0; k--) {
+		right[k] = right[k + 1] * offset[k + 1];
+	}
+	for(int k = 0; k < 6; k++) {
+		weights[k] = left[k] * right[k] * inverse[k];
+	}
+}
+
+void LagrangeWeights(const double *offset, const double *inverse, double *weights) {
+	GPULagrangeWeights(offset, inverse, weights);
+}
+
+// Nodes of the sixth order stencil around one particle. Axes 0 and 1 are the
+// x and y columns, 2 the zz levels of u, v, T and q and 3 the z levels of w.
+// Vertical nodes outside the stencil used near the walls have a unit offset
+// and zero inverse so that their weights vanish.
+struct InterpolationStencil {
+	int ijpts[12], kuvpts[6], kwpts[6];
+	double Offset[4][6], Inverse[4][6];
+};
+
+DEVICE void GPUStencilLevels(const double *__restrict__ levels, const double *__restrict__ denominators, const LevelStencil *stencil, const double position, int *kpts, double *offset, double *inverse) {
+	const double *window = &denominators[stencil->Window];
+	for(int j = 0; j < 6; j++) {
+		kpts[j] = stencil->kpts[j];
+		if(j >= stencil->First && j < stencil->Last) {
+			offset[j] = position - levels[kpts[j]];
+			inverse[j] = window[j - stencil->First];
+		} else {
+			offset[j] = 1.0;
+			inverse[j] = 0.0;
+		}
+	}
+}
+
+// levels holds the zz and z levels found for the particle by the previous
+// interpolation, or -2 to force a full search, and is updated in place.
+DEVICE void GPUInterpolationStencil(const double dx, const double dy, const int nnz, const double *__restrict__ z, const double *__restrict__ zz, const LevelLocator zLocator, const LevelLocator zzLocator, const LevelStencil *__restrict__ zStencils, const LevelStencil *__restrict__ zzStencils, const double *__restrict__ zDenominators, const double *__restrict__ zzDenominators, const double *xp, int *levels, InterpolationStencil *stencil) {
+	// A particle whose position has become NaN keeps NaN weights but gathers
+	// from the first column rather than from outside the field
+	int *ijpts = stencil->ijpts;
+	GPUFindXYNeighbours(dx, dy, xp[0] == xp[0] ? xp[0] : 0.0, xp[1] == xp[1] ? xp[1] : 0.0, ijpts);
+
+	const double cells[2] = {xp[0] / dx, xp[1] / dy};
+	for(int iz = 0; iz < 2; iz++) {
+		for(int j = 0; j < 6; j++) {
+			stencil->Offset[iz][j] = cells[iz] - (ijpts[iz * 6 + j] - 1);
+			stencil->Inverse[iz][j] = cLagrangeUniform[j];
+		}
+	}
+
+	levels[0] = GPULevelTrack(zzLocator, zz, nnz, levels[0], xp[2]);
+	levels[1] = GPULevelTrack(zLocator, z, nnz, levels[1], xp[2]);
+	GPUStencilLevels(zz, zzDenominators, &zzStencils[levels[0] + 1], xp[2], stencil->kuvpts, stencil->Offset[2], stencil->Inverse[2]);
+	GPUStencilLevels(z, zDenominators, &zStencils[levels[1] + 1], xp[2], stencil->kwpts, stencil->Offset[3], stencil->Inverse[3]);
+}
+
+// Accumulates the 6x6x6 stencil. The horizontal and vertical weight products
+// are formed once per column so that each node costs a single multiply.
+template <class View>
+DEVICE void GPUInterpolationGather(const View field, const InterpolationStencil *stencil, const double wt[4][6], const int idx, ParticleArray particles) {
+	double xUF = 0.0, yUF = 0.0, zUF = 0.0, Tf = 0.0, qinf = 0.0;
+	for(int k = 0; k < 6; k++) {
+		const int izuv = stencil->kuvpts[k];
+		const int izw = stencil->kwpts[k];
+		for(int j = 0; j < 6; j++) {
+			const int iy = stencil->ijpts[1 * 6 + j] + 1;
+			const double wtuv = wt[1][j] * wt[2][k];
+			const double wtw = wt[1][j] * wt[3][k];
+			for(int i = 0; i < 6; i++) {
+				const int ix = stencil->ijpts[0 * 6 + i] + 1;
+				const int nuv = field.Index(ix, iy, izuv);
+				const int nw = field.Index(ix, iy, izw);
+				const double wuv = wt[0][i] * wtuv;
+				xUF += field.U(nuv) * wuv;
+				yUF += field.V(nuv) * wuv;
+				zUF += field.W(nw) * (wt[0][i] * wtw);
+				Tf += field.Temperature(nuv) * wuv;
+				qinf += field.Humidity(nuv) * wuv;
+			}
+		}
+	}
+
+	particles.uf[0][idx] = xUF;
+	particles.uf[1][idx] = yUF;
+	particles.uf[2][idx] = zUF;
+	particles.Tf[idx] = Tf;
+	particles.qinf[idx] = qinf;
+}
+
+template <class View>
+GLOBAL void GPUFieldInterpolate(const View field, const double dx, const double dy, const int nnz, const double *__restrict__ z, const double *__restrict__ zz, const LevelLocator zLocator, const LevelLocator zzLocator, const LevelStencil *__restrict__ zStencils, const LevelStencil *__restrict__ zzStencils, const double *__restrict__ zDenominators, const double *__restrict__ zzDenominators, const int cache, const int pcount, ParticleArray particles) {
+	int index_start, index_end, index_stride;
+	GPUKernelRange(pcount, &index_start, &index_end, &index_stride);
+
+	for(int idx = index_start; idx < index_end; idx += index_stride) {
 
 #ifdef BUILD_CUDA
 		extern SHARED double shared[];
@@ -226,429 +494,351 @@ GLOBAL void GPUFieldInterpolate(const int nx, const int ny, const double dx, con
 		const double *zzShared = zz;
 #endif
 
-		int ijpts[12];
-		GPUFindXYNeighbours(dx, dy, &particles[idx], ijpts);
+		const double xp[3] = {particles.xp[0][idx], particles.xp[1][idx], particles.xp[2][idx]};
 
-		int kuvpts[6] = {0, 0, 0, 0, 0, 0};
-		for(; kuvpts[2] < nnz; kuvpts[2]++) {
-			if(zzShared[kuvpts[2]] > particles[idx].xp[2]) {
-				break;
-			}
-		}
-		kuvpts[2] -= 1;
+		int levels[2] = {cache ? particles.level[0][idx] : -2, cache ? particles.level[1][idx] : -2};
 
-		kuvpts[3] = kuvpts[2] + 1;
-		kuvpts[4] = kuvpts[3] + 1;
-		kuvpts[5] = kuvpts[4] + 1;
-		kuvpts[1] = kuvpts[2] - 1;
-		kuvpts[0] = kuvpts[1] - 1;
+		InterpolationStencil stencil;
+		GPUInterpolationStencil(dx, dy, nnz, zShared, zzShared, zLocator, zzLocator, zStencils, zzStencils, zDenominators, zzDenominators, xp, levels, &stencil);
+		particles.level[0][idx] = levels[0];
+		particles.level[1][idx] = levels[1];
 
-		int kwpts[6] = {0, 0, 0, 0, 0, 0};
-		for(; kwpts[2] < nnz; kwpts[2]++) {
-			if(zShared[kwpts[2]] > particles[idx].xp[2]) {
-				break;
-			}
-		}
-		kwpts[2] -= 1;
-
-		kwpts[3] = kwpts[2] + 1;
-		kwpts[4] = kwpts[3] + 1;
-		kwpts[5] = kwpts[4] + 1;
-		kwpts[1] = kwpts[2] - 1;
-		kwpts[0] = kwpts[1] - 1;
-
-		double wt[4][6] = {
-			{0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
-			{0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
-			{0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
-			{0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
-		};
-
-		double dxvec[2] = {dx, dy};
-		for(int iz = 0; iz < 2; iz++) {
-			for(int j = 0; j < 6; j++) {
-				double xjval = dxvec[iz] * (ijpts[iz * 6 + j] - 1);
-				double pj = 1.0;
-				for(int k = 0; k < 6; k++) {
-					double xkval = dxvec[iz] * (ijpts[iz * 6 + k] - 1);
-					if(j != k) {
-						pj = pj * (particles[idx].xp[iz] - xkval) / (xjval - xkval);
-					}
-				}
-				wt[iz][j] = pj;
-			}
+		double wt[4][6];
+		for(int axis = 0; axis < 4; axis++) {
+			GPULagrangeWeights(stencil.Offset[axis], stencil.Inverse[axis], wt[axis]);
 		}
 
-		int first, last;
-		if(kuvpts[2] == 1) {
-			first = 2;
-			last = 4;
-			kuvpts[0] = 0;
-			kuvpts[1] = 0;
-		} else if(kuvpts[2] == 0) {
-			first = 3;
-			last = 5;
-			kuvpts[0] = 0;
-			kuvpts[1] = 0;
-			kuvpts[2] = 0;
-		} else if(kuvpts[2] < 0) {
-			first = 0;
-			last = 0;
-			kuvpts[0] = 0;
-			kuvpts[1] = 0;
-			kuvpts[2] = 0;
-		} else if(kuvpts[2] == 2) {
-			first = 1;
-			last = 5;
-		} else if(kuvpts[2] == nnz - 2) {
-			first = 1;
-			last = 3;
-			kuvpts[3] = nnz - 2;
-			kuvpts[4] = nnz - 2;
-			kuvpts[5] = nnz - 2;
-		} else if(kuvpts[2] > nnz - 2) {
-			first = 0;
-			last = 0;
-			kuvpts[3] = nnz - 2;
-			kuvpts[4] = nnz - 2;
-			kuvpts[5] = nnz - 2;
-		} else if(kuvpts[2] == nnz - 3) {
-			first = 2;
-			last = 4;
-			kuvpts[4] = nnz - 2;
-			kuvpts[5] = nnz - 2;
-		} else if(kuvpts[2] == nnz - 4) {
-			first = 1;
-			last = 5;
-		} else {
-			first = 0;
-			last = 6;
-		}
+		GPUInterpolationGather(field, &stencil, wt, idx, particles);
+	}
+}
 
-		for(int j = first; j < last; j++) {
-			double xjval = zzShared[kuvpts[j]];
-			double pj = 1.0;
-			for(int k = first; k < last; k++) {
-				double xkval = zzShared[kuvpts[k]];
-				if(j != k) {
-					pj = pj * (particles[idx].xp[2] - xkval) / (xjval - xkval);
-				}
-			}
-			wt[2][j] = pj;
-		}
-
-		if(kwpts[2] == 0) {
-			first = 2;
-			last = 4;
-			kwpts[0] = 0;
-			kwpts[1] = 0;
-		} else if(kwpts[2] < 0) {
-			first = 0;
-			last = 0;
-			kwpts[0] = 0;
-			kwpts[1] = 0;
-			kwpts[2] = 0;
-		} else if(kwpts[2] == 1) {
-			first = 1;
-			last = 5;
-			kwpts[0] = 0;
-		} else if(kwpts[2] >= nnz - 2) {
-			first = 0;
-			last = 0;
-			kwpts[3] = nnz - 2;
-			kwpts[4] = nnz - 2;
-			kwpts[5] = nnz - 2;
-		} else if(kwpts[2] == nnz - 3) {
-			first = 2;
-			last = 4;
-			kwpts[4] = nnz - 2;
-			kwpts[5] = nnz - 2;
-		} else if(kwpts[2] == nnz - 4) {
-			first = 1;
-			last = 5;
-			kwpts[0] = 0;
-		} else {
-			first = 0;
-			last = 6;
-		}
+// Constants of the droplet update that depend only on the parameters and the
+// time step, evaluated once per call on the host.
+StepConstants StepConstantsBuild(const Parameters *params, const double dt) {
+	StepConstants retVal;
+
+	const double pi = 4.0 * atan(1.0);
+	const double pi2 = 2.0 * pi;
+	const double zetas[3] = {0.0, -17.0 / 60.0, -5.0 / 12.0};
+	const double gama[3] = {8.0 / 15.0, 5.0 / 12.0, 3.0 / 4.0};
+
+	retVal.m_s = params->Sal / 1000.0 * 4.0 / 3.0 * pi * pow(params->radius_mass, 3) * params->rhow;
+	retVal.CpaCpp = params->Cpa / params->Cpp;
+	retVal.Lv = (25.0 - 0.02274 * 26.0) * 100000;
+	retVal.pPra = pow(params->Pra, 1.0 / 3.0);
+	retVal.pSc = pow(params->Sc, 1.0 / 3.0);
+	retVal.g[0] = 0.0;
+	retVal.g[1] = 0.0;
+	retVal.g[2] = params->part_grav;
+
+	retVal.nuf = params->nuf;
+	retVal.rhow = params->rhow;
+	retVal.rhoa = params->rhoa;
+	retVal.Pra = params->Pra;
+	retVal.Sc = params->Sc;
+	retVal.Evaporation = params->Evaporation;
+
+	retVal.Volp = pi2 * 2.0 / 3.0;
+	retVal.taup = 18.0 * params->rhoa * params->nuf;
+	retVal.EffC = 2.0 * params->Mw * params->Gam;
+	retVal.EffCDenominator = params->Ru * params->rhow;
+	retVal.EffS = params->Ion * params->Os * retVal.m_s * params->Mw / params->Ms;
+	retVal.estar = params->Mw * retVal.Lv / params->Ru;
+	retVal.qstar = params->Mw / params->Ru;
+	retVal.TprhsL = 3.0 * retVal.Lv / params->Cpp;
+
+	for(int istage = 0; istage < 3; istage++) {
+		retVal.dtZ[istage] = dt * zetas[istage];
+		retVal.dtG[istage] = dt * gama[istage];
+	}
+	return retVal;
+}
 
-		for(int j = first; j < last; j++) {
-			double xjval = zShared[kwpts[j]];
-			double pj = 1.0;
-			for(int k = first; k < last; k++) {
-				double xkval = zShared[kwpts[k]];
-				if(j != k) {
-					pj = pj * (particles[idx].xp[2] - xkval) / (xjval - xkval);
-				}
-			}
-			wt[3][j] = pj;
-		}
-
-		particles[idx].uf[0] = 0.0;
-		particles[idx].uf[1] = 0.0;
-		particles[idx].uf[2] = 0.0;
-
-		particles[idx].Tf = 0.0;
-		particles[idx].qinf = 0.0;
-		for(int k = 0; k < 6; k++) {
-			for(int j = 0; j < 6; j++) {
-				for(int i = 0; i < 6; i++) {
-					const int ix = ijpts[0 * 6 + i];
-					const int iy = ijpts[1 * 6 + j];
-					const int izuv = kuvpts[k];
-					const int izw = kwpts[k];
-					particles[idx].uf[0] = particles[idx].uf[0] + uext[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wt[0][i] * wt[1][j] * wt[2][k];
-					particles[idx].uf[1] = particles[idx].uf[1] + vext[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wt[0][i] * wt[1][j] * wt[2][k];
-					particles[idx].uf[2] = particles[idx].uf[2] + wext[(ix + 1) + (iy + 1) * nx + izw * ny * nx] * wt[0][i] * wt[1][j] * wt[3][k];
-					particles[idx].Tf = particles[idx].Tf + Text[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wt[0][i] * wt[1][j] * wt[2][k];
-					particles[idx].qinf = particles[idx].qinf + T2ext[(ix + 1) + (iy + 1) * nx + izuv * ny * nx] * wt[0][i] * wt[1][j] * wt[2][k];
-				}
-			}
+DEVICE void GPUUpdateParticle(const StepConstants c, const int it, const int istage, const int idx, ParticleArray particles) {
+	const double dtZ = c.dtZ[istage];
+	const double dtG = c.dtG[istage];
+
+	if(it == 1) {
+		for(int j = 0; j < 3; j++) {
+			particles.vp[j][idx] = particles.uf[j][idx];
 		}
+		particles.Tp[idx] = particles.Tf[idx];
 	}
-}
 
-GLOBAL void GPUUpdateParticles(const int it, const int istage, const double dt, const int pcount, Particle *__restrict__ particles) {
-	int index_start = 0, index_stride = 1;
-#ifdef BUILD_CUDA
-	index_start = blockIdx.x * blockDim.x + threadIdx.x;
-	index_stride = blockDim.x * gridDim.x;
-#endif
+	double diff[3];
+	for(int j = 0; j < 3; j++) {
+		diff[j] = particles.vp[j][idx] - particles.uf[j][idx];
+	}
+	double diffnorm = sqrt(diff[0] * diff[0] + diff[1] * diff[1] + diff[2] * diff[2]);
+	double Rep = 2.0 * particles.radius[idx] * diffnorm / c.nuf;
+	double Volp = c.Volp * (particles.radius[idx] * particles.radius[idx] * particles.radius[idx]);
+	double rhop = (c.m_s + Volp * c.rhow) / Volp;
+	double taup_i = c.taup / rhop / ((2.0 * particles.radius[idx]) * (2.0 * particles.radius[idx]));
+
+	double corrfac = 1.0 + 0.15 * pow(Rep, 0.687);
+	double Nup = 2.0 + 0.6 * sqrt(Rep) * c.pPra;
+	double Shp = 2.0 + 0.6 * sqrt(Rep) * c.pSc;
+
+	double TfC = particles.Tf[idx] - 273.15;
+	double einf = 610.94 * exp(17.6257 * TfC / (TfC + 243.04));
+	double Eff_C = c.EffC / (c.EffCDenominator * particles.radius[idx] * particles.Tp[idx]);
+	double Eff_S = c.EffS / (Volp * rhop - c.m_s);
+	double estar = einf * exp(c.estar * (1.0 / particles.Tf[idx] - 1.0 / particles.Tp[idx]) + Eff_C - Eff_S);
+	particles.qstar[idx] = c.qstar * estar / particles.Tp[idx] / c.rhoa;
+
+	double xtmp[3], vtmp[3];
+	for(int j = 0; j < 3; j++) {
+		xtmp[j] = particles.xp[j][idx] + dtZ * particles.xrhs[j][idx];
+		vtmp[j] = particles.vp[j][idx] + dtZ * particles.vrhs[j][idx];
+	}
 
-	for(int idx = index_start; idx < pcount; idx += index_stride) {
+	double Tptmp = particles.Tp[idx] + dtZ * particles.Tprhs_s[idx];
+	Tptmp += dtZ * particles.Tprhs_L[idx];
+	double radiustmp = particles.radius[idx] + dtZ * particles.radrhs[idx];
 
-#ifdef BUILD_CUDA
-		SHARED double pi, pi2, m_s, CpaCpp, Lv, pPra, pSc, zetas[3], gama[3], g[3], dtZ, dtG;
+	for(int j = 0; j < 3; j++) {
+		particles.xrhs[j][idx] = particles.vp[j][idx];
+	}
 
-		if(threadIdx.x == 0) {
-			pi = 4.0 * atan(1.0);
-			pi2 = 2.0 * pi;
-			m_s = cParams.Sal / 1000.0 * 4.0 / 3.0 * pi * pow(cParams.radius_mass, 3) * cParams.rhow;
+	for(int j = 0; j < 3; j++) {
+		particles.vrhs[j][idx] = corrfac * taup_i * (particles.uf[j][idx] - particles.vp[j][idx]) - c.g[j];
+	}
 
-			CpaCpp = cParams.Cpa / cParams.Cpp;
+	particles.radrhs[idx] = Shp / 9.0 / c.Sc * rhop / c.rhow * particles.radius[idx] * taup_i * (particles.qinf[idx] - particles.qstar[idx]) * c.Evaporation;
+	particles.Tprhs_s[idx] = -Nup / 3.0 / c.Pra * c.CpaCpp * rhop / c.rhow * taup_i * (particles.Tp[idx] - particles.Tf[idx]);
+	particles.Tprhs_L[idx] = c.TprhsL / particles.radius[idx] * particles.radrhs[idx];
 
-			zetas[0] = 0.0;
-			zetas[1] = -17.0 / 60.0;
-			zetas[2] = -5.0 / 12.0;
-			gama[0] = 8.0 / 15.0;
-			gama[1] = 5.0 / 12.0;
-			gama[2] = 3.0 / 4.0;
-			g[0] = 0.0;
-			g[1] = 0.0;
-			g[2] = cParams.part_grav;
-			Lv = (25.0 - 0.02274 * 26.0) * 100000;
+	for(int j = 0; j < 3; j++) {
+		particles.xp[j][idx] = xtmp[j] + dtG * particles.xrhs[j][idx];
+		particles.vp[j][idx] = vtmp[j] + dtG * particles.vrhs[j][idx];
+	}
+	particles.Tp[idx] = Tptmp + dtG * particles.Tprhs_s[idx];
+	particles.Tp[idx] += +dtG * particles.Tprhs_L[idx];
+	particles.radius[idx] = radiustmp + dtG * particles.radrhs[idx];
+}
 
-			pPra = pow(cParams.Pra, 1.0 / 3.0);
-			pSc = pow(cParams.Sc, 1.0 / 3.0);
+DEVICE void GPUUpdateParticleNonperiodic(const double zMax, const int idx, ParticleArray particles) {
+	const double zPos = particles.xp[2][idx];
 
-			dtZ = dt * zetas[istage];
-			dtG = dt * gama[istage];
-		}
-		__syncthreads();
-#else
-		const double pi = 4.0 * atan(1.0);
-		const double pi2 = 2.0 * pi;
-		const double m_s = cParams.Sal / 1000.0 * 4.0 / 3.0 * pi * pow(cParams.radius_mass, 3) * cParams.rhow;
+	//const double top = zMax - particles.radius[idx];
+	//const double bot = 0.0 + particles.radius[idx];
+	const double top = zMax - 0.2;
+	const double bot = 0.0 + 0.2;
 
-		const double CpaCpp = cParams.Cpa / cParams.Cpp;
+	if(zPos > top) {
+		particles.xp[2][idx] = top - (zPos - top);
+		particles.vp[2][idx] = -particles.vp[2][idx];
+	} else if(zPos < bot) {
+		particles.xp[2][idx] = bot + (bot - zPos);
+		particles.vp[2][idx] = -particles.vp[2][idx];
+	}
+}
 
-		const double zetas[3] = {0.0, -17.0 / 60.0, -5.0 / 12.0};
-		const double gama[3] = {8.0 / 15.0, 5.0 / 12.0, 3.0 / 4.0};
-		const double g[3] = {0.0, 0.0, cParams.part_grav};
-		const double Lv = (25.0 - 0.02274 * 26.0) * 100000;
-		const double pPra = pow(cParams.Pra, 1.0 / 3.0);
-		const double pSc = pow(cParams.Sc, 1.0 / 3.0);
+DEVICE void GPUUpdateParticlePeriodic(const double grid_width, const double grid_height, const int idx, ParticleArray particles) {
+	const double xPos = particles.xp[0][idx];
+	const double yPos = particles.xp[1][idx];
 
-		const double dtZ = dt * zetas[istage];
-		const double dtG = dt * gama[istage];
-#endif
+	if(xPos > grid_width) {
+		particles.xp[0][idx] -= grid_width;
+	} else if(xPos < 0.0) {
+		particles.xp[0][idx] = grid_width + xPos;
+	}
 
-		if(it == 1) {
-			for(int j = 0; j < 3; j++) {
-				particles[idx].vp[j] = particles[idx].uf[j];
-			}
-			particles[idx].Tp = particles[idx].Tf;
-		}
+	if(yPos > grid_height) {
+		particles.xp[1][idx] -= grid_height;
+	} else if(yPos < 0.0) {
+		particles.xp[1][idx] = grid_height + yPos;
+	}
+}
 
-		double diff[3];
-		for(int j = 0; j < 3; j++) {
-			diff[j] = particles[idx].vp[j] - particles[idx].uf[j];
-		}
-		double diffnorm = sqrt(diff[0] * diff[0] + diff[1] * diff[1] + diff[2] * diff[2]);
-		double Rep = 2.0 * particles[idx].radius * diffnorm / cParams.nuf;
-		double Volp = pi2 * 2.0 / 3.0 * (particles[idx].radius * particles[idx].radius * particles[idx].radius);
-		double rhop = (m_s + Volp * cParams.rhow) / Volp;
-		double taup_i = 18.0 * cParams.rhoa * cParams.nuf / rhop / ((2.0 * particles[idx].radius) * (2.0 * particles[idx].radius));
-
-		double corrfac = 1.0 + 0.15 * pow(Rep, 0.687);
-		double Nup = 2.0 + 0.6 * pow(Rep, 0.5) * pPra;
-		double Shp = 2.0 + 0.6 * pow(Rep, 0.5) * pSc;
-
-		double TfC = particles[idx].Tf - 273.15;
-		double einf = 610.94 * exp(17.6257 * TfC / (TfC + 243.04));
-		double Eff_C = 2.0 * cParams.Mw * cParams.Gam / (cParams.Ru * cParams.rhow * particles[idx].radius * particles[idx].Tp);
-		double Eff_S = cParams.Ion * cParams.Os * m_s * cParams.Mw / cParams.Ms / (Volp * rhop - m_s);
-		double estar = einf * exp(cParams.Mw * Lv / cParams.Ru * (1.0 / particles[idx].Tf - 1.0 / particles[idx].Tp) + Eff_C - Eff_S);
-		particles[idx].qstar = cParams.Mw / cParams.Ru * estar / particles[idx].Tp / cParams.rhoa;
-
-		double xtmp[3], vtmp[3];
-		for(int j = 0; j < 3; j++) {
-			xtmp[j] = particles[idx].xp[j] + dtZ * particles[idx].xrhs[j];
-			vtmp[j] = particles[idx].vp[j] + dtZ * particles[idx].vrhs[j];
-		}
+GLOBAL void GPUUpdateParticles(const StepConstants constants, const int it, const int istage, const int pcount, ParticleArray particles) {
+	int index_start, index_end, index_stride;
+	GPUKernelRange(pcount, &index_start, &index_end, &index_stride);
 
-		double Tptmp = particles[idx].Tp + dtZ * particles[idx].Tprhs_s;
-		Tptmp += dtZ * particles[idx].Tprhs_L;
-		double radiustmp = particles[idx].radius + dtZ * particles[idx].radrhs;
+	for(int idx = index_start; idx < index_end; idx += index_stride) {
+		GPUUpdateParticle(constants, it, istage, idx, particles);
+	}
+}
 
-		for(int j = 0; j < 3; j++) {
-			particles[idx].xrhs[j] = particles[idx].vp[j];
-		}
+GLOBAL void GPUUpdateNonperiodic(const double xMax, const double yMax, const double zMax, const int pcount, ParticleArray particles) {
+	int index_start, index_end, index_stride;
+	GPUKernelRange(pcount, &index_start, &index_end, &index_stride);
 
-		for(int j = 0; j < 3; j++) {
-			particles[idx].vrhs[j] = corrfac * taup_i * (particles[idx].uf[j] - particles[idx].vp[j]) - g[j];
-		}
+	for(int idx = index_start; idx < index_end; idx += index_stride) {
+		GPUUpdateParticleNonperiodic(zMax, idx, particles);
+	}
+}
 
-		particles[idx].radrhs = Shp / 9.0 / cParams.Sc * rhop / cParams.rhow * particles[idx].radius * taup_i * (particles[idx].qinf - particles[idx].qstar) * cParams.Evaporation;
-		particles[idx].Tprhs_s = -Nup / 3.0 / cParams.Pra * CpaCpp * rhop / cParams.rhow * taup_i * (particles[idx].Tp - particles[idx].Tf);
-		particles[idx].Tprhs_L = 3.0 * Lv / cParams.Cpp / particles[idx].radius * particles[idx].radrhs;
+GLOBAL void GPUUpdatePeriodic(const double grid_width, const double grid_height, const int pcount, ParticleArray particles) {
+	int index_start, index_end, index_stride;
+	GPUKernelRange(pcount, &index_start, &index_end, &index_stride);
 
-		for(int j = 0; j < 3; j++) {
-			particles[idx].xp[j] = xtmp[j] + dtG * particles[idx].xrhs[j];
-			particles[idx].vp[j] = vtmp[j] + dtG * particles[idx].vrhs[j];
-		}
-		particles[idx].Tp = Tptmp + dtG * particles[idx].Tprhs_s;
-		particles[idx].Tp += +dtG * particles[idx].Tprhs_L;
-		particles[idx].radius = radiustmp + dtG * particles[idx].radrhs;
+	for(int idx = index_start; idx < index_end; idx += index_stride) {
+		GPUUpdateParticlePeriodic(grid_width, grid_height, idx, particles);
+	}
+}
+
+// Statistics
+//
+// A reduction slice holds StatisticsFields sums for every z level followed by
+// the radius sum, minimum and maximum. Host threads and CUDA blocks each fill
+// their own slice, and only slices ever leave the device.
+HOST_DEVICE int StatisticsSize(const int nnz) {
+	return nnz * StatisticsFields + 3;
+}
+
+HOST_DEVICE void StatisticsClear(const int nnz, double *stats) {
+	for(int i = 0; i < nnz * StatisticsFields; i++) {
+		stats[i] = 0.0;
 	}
+	stats[nnz * StatisticsFields + 0] = 0.0;
+	stats[nnz * StatisticsFields + 1] = 1.0;
+	stats[nnz * StatisticsFields + 2] = -1.0;
 }
 
-GLOBAL void GPUUpdateNonperiodic(const double xMax, const double yMax, const double zMax, const int pcount, Particle *__restrict__ particles) {
-	int index_start = 0, index_stride = 1;
+DEVICE void GPUStatisticsAdd(double *sum, const double value) {
 #ifdef BUILD_CUDA
-	index_start = blockIdx.x * blockDim.x + threadIdx.x;
-	index_stride = blockDim.x * gridDim.x;
+	atomicAdd(sum, value);
+#else
+	*sum += value;
 #endif
-        const double xMin = 0.0;
-        const double yMin = 0.0;
-        const double zMin = 0.0;
-
-	for(int idx = index_start; idx < pcount; idx += index_stride) {
-		const double radius = particles[idx].radius;
-		const double zPos = particles[idx].xp[2];
-
-		//const double top = zMax - radius;
-		//const double bot = 0.0 + radius;
-		const double top = zMax - 0.2;
-		const double bot = 0.0 + 0.2;
-
-		if(zPos > top) {
-			particles[idx].xp[2] = top - (zPos - top);
-			particles[idx].vp[2] = -particles[idx].vp[2];
-			
-			//particles[idx].xp[0] = xMax/2.0;
-                        //particles[idx].xp[1] = yMax/2.0;
-                        //particles[idx].xp[2] = zMax/2.0;
-                        
-		} else if(zPos < bot) {
-			particles[idx].xp[2] = bot + (bot - zPos);
-			particles[idx].vp[2] = -particles[idx].vp[2];
-			
-			//particles[idx].xp[0] = xMax/2.0;
-                        //particles[idx].xp[1] = yMax/2.0;
-                        //particles[idx].xp[2] = zMax/2.0;
-		}
-	}
-}
-
-GLOBAL void GPUUpdatePeriodic(const double grid_width, const double grid_height, const int pcount, Particle *__restrict__ particles) {
-	int index_start = 0, index_stride = 1;
+}
+
+// The bit patterns of doubles do not order like their values once negative
+// (the maximum starts at -1), so CUDA compares them as doubles and swaps
+DEVICE void GPUStatisticsMin(double *minimum, const double value) {
 #ifdef BUILD_CUDA
-	index_start = blockIdx.x * blockDim.x + threadIdx.x;
-	index_stride = blockDim.x * gridDim.x;
+	unsigned long long *address = (unsigned long long *)minimum, old = *address;
+	while(value < __longlong_as_double((long long)old)) {
+		const unsigned long long assumed = old;
+		old = atomicCAS(address, assumed, (unsigned long long)__double_as_longlong(value));
+		if(old == assumed) break;
+	}
+#else
+	if(value < *minimum) *minimum = value;
 #endif
+}
 
-	for(int idx = index_start; idx < pcount; idx += index_stride) {
-		const double xPos = particles[idx].xp[0];
-		const double yPos = particles[idx].xp[1];
+DEVICE void GPUStatisticsMax(double *maximum, const double value) {
+#ifdef BUILD_CUDA
+	unsigned long long *address = (unsigned long long *)maximum, old = *address;
+	while(value > __longlong_as_double((long long)old)) {
+		const unsigned long long assumed = old;
+		old = atomicCAS(address, assumed, (unsigned long long)__double_as_longlong(value));
+		if(old == assumed) break;
+	}
+#else
+	if(value > *maximum) *maximum = value;
+#endif
+}
 
-		if(xPos > grid_width) {
-			particles[idx].xp[0] -= grid_width;
-		} else if(xPos < 0.0) {
-			particles[idx].xp[0] = grid_width + xPos;
-		}
+// Particles outside the levels are binned into the nearest one
+DEVICE void GPUStatisticsAccumulate(const int nnz, const double *__restrict__ z, const LevelLocator zLocator, const int idx, const ParticleArray particles, double *stats) {
+	const int kpt = MIN(MAX(GPULevelLocate(zLocator, z, nnz, particles.xp[2][idx]), 0), nnz - 1);
+	double *bin = &stats[kpt * StatisticsFields];
 
-		if(yPos > grid_height) {
-			particles[idx].xp[1] -= grid_height;
-		} else if(yPos < 0.0) {
-			particles[idx].xp[1] = grid_height + yPos;
-		}
+	GPUStatisticsAdd(&bin[STAT_COUNT], 1.0);
+	for(int j = 0; j < 3; j++) {
+		GPUStatisticsAdd(&bin[STAT_VP + j], particles.vp[j][idx]);
+		GPUStatisticsAdd(&bin[STAT_VPSQ + j], particles.vp[j][idx] * particles.vp[j][idx]);
 	}
+	GPUStatisticsAdd(&bin[STAT_RADIUS], particles.radius[idx]);
+	GPUStatisticsAdd(&bin[STAT_TP], particles.Tp[idx]);
+	GPUStatisticsAdd(&bin[STAT_TF], particles.Tf[idx]);
+	GPUStatisticsAdd(&bin[STAT_QF], particles.qinf[idx]);
+	GPUStatisticsAdd(&bin[STAT_QSTAR], particles.qstar[idx]);
+
+	double *global = &stats[nnz * StatisticsFields];
+	GPUStatisticsAdd(&global[0], particles.radius[idx]);
+	GPUStatisticsMin(&global[1], particles.radius[idx]);
+	GPUStatisticsMax(&global[2], particles.radius[idx]);
 }
 
-void GPUCalculateStatistics(const int nnz, const double *__restrict__ z, double *__restrict__ partcount_t, double *__restrict__ vpsum_t, double *__restrict__ vpsqrsum_t, double *__restrict__ rpsum_t, double *__restrict__ tpsum_t, double *__restrict__ tfsum_t, double *__restrict__ qfsum_t, double *__restrict__ qstarsum_t,  const int pcount, Particle *__restrict__ particles, double *part_stats) {
-
-        double radsum = 0.0;
-        double radmin = 1.0;
-        double radmax = -1.0;
-	for(int i = 0; i < pcount; i++) {
-		int kpt = 0;
-		for(; kpt < nnz; kpt++) {
-			if(z[kpt] > particles[i].xp[2]) {
-				break;
-			}
-		}
-		kpt -= 1;
+// A CUDA block reduces into a shared slice that is added to the device slice
+// once the block is done
+DEVICE void GPUStatisticsBegin(const int nnz, double *local) {
+#ifdef BUILD_CUDA
+	if(threadIdx.x == 0) {
+		StatisticsClear(nnz, local);
+	}
+	__syncthreads();
+#endif
+}
 
-		partcount_t[kpt] += 1.0;
+DEVICE void GPUStatisticsEnd(const int nnz, const double *local, double *stats) {
+#ifdef BUILD_CUDA
+	__syncthreads();
+	const int sums = nnz * StatisticsFields + 1;
+	for(int i = threadIdx.x; i < sums; i += blockDim.x) {
+		atomicAdd(&stats[i], local[i]);
+	}
+	if(threadIdx.x == 0) {
+		GPUStatisticsMin(&stats[sums], local[sums]);
+		GPUStatisticsMax(&stats[sums + 1], local[sums + 1]);
+	}
+#endif
+}
 
-		vpsum_t[kpt * 3 + 0] += particles[i].vp[0];
-		vpsum_t[kpt * 3 + 1] += particles[i].vp[1];
-		vpsum_t[kpt * 3 + 2] += particles[i].vp[2];
+// Runs every RK stage of every substep, with both boundary updates, on one
+// particle before moving to the next so its state stays in cache. When stats
+// is set every particle is also added to the statistics once it has finished
+// its final stage.
+GLOBAL void GPUAdvanceParticles(const StepConstants constants, const int it, const int substeps, const double grid_width, const double grid_height, const double zMax, const int nnz, const double *__restrict__ z, const LevelLocator zLocator, double *stats, const int pcount, ParticleArray particles) {
+	int index_start, index_end, index_stride;
+	GPUKernelRange(pcount, &index_start, &index_end, &index_stride);
 
-		vpsqrsum_t[kpt * 3 + 0] += (particles[i].vp[0] * particles[i].vp[0]);
-		vpsqrsum_t[kpt * 3 + 1] += (particles[i].vp[1] * particles[i].vp[1]);
-		vpsqrsum_t[kpt * 3 + 2] += (particles[i].vp[2] * particles[i].vp[2]);
+#ifdef BUILD_CUDA
+	extern __shared__ double local[];
+	if(stats) GPUStatisticsBegin(nnz, local);
+#else
+	double *local = stats;
+#endif
 
-                rpsum_t[kpt] += particles[i].radius;
-                tpsum_t[kpt] += particles[i].Tp;
-                tfsum_t[kpt] += particles[i].Tf;
-                qfsum_t[kpt] += particles[i].qinf;
-                qstarsum_t[kpt] += particles[i].qstar;
+	for(int idx = index_start; idx < index_end; idx += index_stride) {
+		for(int step = 0; step < substeps; step++) {
+			for(int istage = 0; istage < 3; istage++) {
+				GPUUpdateParticle(constants, it, istage, idx, particles);
+				GPUUpdateParticleNonperiodic(zMax, idx, particles);
+				GPUUpdateParticlePeriodic(grid_width, grid_height, idx, particles);
+			}
+		}
+		if(stats) GPUStatisticsAccumulate(nnz, z, zLocator, idx, particles, local);
+	}
 
-                radsum += particles[i].radius;
+#ifdef BUILD_CUDA
+	if(stats) GPUStatisticsEnd(nnz, local, stats);
+#endif
+}
 
-                //part_stats = radmean, radmin, radmax, xp1,xp2,xp3,vp1,vp2,vp3,uf1,uf2,uf3,rad1,Tp1,Tf1,qinf,qstar;
-                
-                if(particles[i].radius > radmax){
-                  radmax = particles[i].radius;
-                }
-                if(particles[i].radius < radmin){
-                  radmin = particles[i].radius;
-                }
+// Reduces the particles into stats. A host thread owns its slice; a CUDA block
+// reduces into shared memory and then adds its slice to the device slice.
+GLOBAL void GPUCalculateStatistics(const int nnz, const double *__restrict__ z, const LevelLocator zLocator, const int pcount, const ParticleArray particles, double *stats) {
+	int index_start, index_end, index_stride;
+	GPUKernelRange(pcount, &index_start, &index_end, &index_stride);
 
-                if(i == 1){
-                  part_stats[3] = particles[i].xp[0];
-                  part_stats[4] = particles[i].xp[1];
-                  part_stats[5] = particles[i].xp[2];
-                  part_stats[6] = particles[i].vp[0];
-                  part_stats[7] = particles[i].vp[1];
-                  part_stats[8] = particles[i].vp[2];
-                  part_stats[9] = particles[i].uf[0];
-                  part_stats[10] = particles[i].uf[1];
-                  part_stats[11] = particles[i].uf[2];
-                  part_stats[12] = particles[i].radius;
-                  part_stats[13] = particles[i].Tp;
-                  part_stats[14] = particles[i].Tf;
-                  part_stats[15] = particles[i].qinf;
-                  part_stats[16] = particles[i].qstar;
-                 }
+#ifdef BUILD_CUDA
+	extern __shared__ double local[];
+	GPUStatisticsBegin(nnz, local);
+#else
+	double *local = stats;
+#endif
 
+	for(int idx = index_start; idx < index_end; idx += index_stride) {
+		GPUStatisticsAccumulate(nnz, z, zLocator, idx, particles, local);
 	}
 
-                part_stats[0] = radsum/pcount;
-                part_stats[1] = radmin;
-                part_stats[2] = radmax;
+#ifdef BUILD_CUDA
+	GPUStatisticsEnd(nnz, local, stats);
+#endif
+}
+
+// Merges the slice of one thread or device into total
+void StatisticsMerge(const int nnz, const double *slice, double *total) {
+	for(int i = 0; i < nnz * StatisticsFields + 1; i++) {
+		total[i] += slice[i];
+	}
+	total[nnz * StatisticsFields + 1] = MIN(total[nnz * StatisticsFields + 1], slice[nnz * StatisticsFields + 1]);
+	total[nnz * StatisticsFields + 2] = MAX(total[nnz * StatisticsFields + 2], slice[nnz * StatisticsFields + 2]);
 }
 
 const int random_NTAB = 32;
@@ -702,421 +892,3489 @@ extern "C" double rand2() {
 	return MIN(AM * random_iy, RNMX);
 }
 
-void SetDeviceIndex(GPU *gpu, const unsigned int index) {
-#ifdef BUILD_CUDA
-	if(gpu->cDevice != index) {
-		gpu->cDevice = index;
-		gpuErrchk(cudaSetDevice(gpu->cDevice));
+// Philox4x32-10 counter based generator (Salmon et al., SC11). Every output
+// block is a pure function of its counter and key, so any thread can draw any
+// particle's numbers without shared state.
+HOST_DEVICE void GPUPhilox4x32(const unsigned int *counter, const unsigned int *key, unsigned int *result) {
+	const unsigned int M0 = 0xD2511F53u, M1 = 0xCD9E8D57u, W0 = 0x9E3779B9u, W1 = 0xBB67AE85u;
+
+	unsigned int c[4] = {counter[0], counter[1], counter[2], counter[3]};
+	unsigned int k[2] = {key[0], key[1]};
+	for(int round = 0; round < 10; round++) {
+		const unsigned long long p0 = (unsigned long long)M0 * c[0];
+		const unsigned long long p1 = (unsigned long long)M1 * c[2];
+		const unsigned int hi0 = p0 >> 32, lo0 = (unsigned int)p0;
+		const unsigned int hi1 = p1 >> 32, lo1 = (unsigned int)p1;
+
+		c[0] = hi1 ^ c[1] ^ k[0];
+		c[1] = lo1;
+		c[2] = hi0 ^ c[3] ^ k[1];
+		c[3] = lo0;
+
+		k[0] += W0;
+		k[1] += W1;
 	}
-#endif
-}
 
-Device *GetDeviceMemory(GPU *gpu) {
-#ifdef BUILD_CUDA
-	return &gpu->mDevices[gpu->cDevice];
-#else
-	return nullptr;
-#endif
+	for(int i = 0; i < 4; i++) {
+		result[i] = c[i];
+	}
 }
 
-extern "C" GPU *NewGPU(const int particles, const int width, const int height, const int depth, const double fWidth, const double fHeight, const double fDepth, double *z, double *zz, const Parameters *params) {
-	GPU *retVal = (GPU *)malloc(sizeof(GPU));
+// Uniform double in [0, 1) for draw number draw of stream stream of the
+// particle pidx. The key holds the seed and the counter the remaining fields.
+HOST_DEVICE double GPURandomUniform(const unsigned int seed, const unsigned int pidx, const unsigned int stream, const unsigned int draw) {
+	const unsigned int counter[4] = {pidx, stream, draw, 0u};
+	const unsigned int key[2] = {seed, 0u};
 
-	// Particle Data
-	retVal->pCount = particles;
-#ifdef BUILD_CUDA
-	gpuErrchk(cudaMallocHost((void **)&retVal->hParticles, sizeof(Particle) * particles));
-#else
-	retVal->hParticles = (Particle *)malloc(sizeof(Particle) * particles);
-#endif
+	unsigned int block[4];
+	GPUPhilox4x32(counter, key, block);
 
-	// Field Data
-	retVal->FieldWidth = fWidth;
-	retVal->FieldHeight = fHeight;
-	retVal->FieldDepth = fDepth;
+	const unsigned long long bits = ((unsigned long long)(block[0] >> 5) << 26) | (block[1] >> 6);
+	return bits * (1.0 / 9007199254740992.0);
+}
 
-	// Grid Data
-	retVal->GridWidth = width;
-	retVal->GridHeight = height;
-	retVal->GridDepth = depth;
+double ParticleRandom(const unsigned int seed, const unsigned int pidx, const unsigned int stream, const unsigned int draw) {
+	return GPURandomUniform(seed, pidx, stream, draw);
+}
 
-	// Statistics
-	retVal->hPartCount = (double *)malloc(sizeof(double) * retVal->GridDepth);
-	retVal->hVPSum = (double *)malloc(sizeof(double) * retVal->GridDepth * 3);
-	retVal->hVPSumSQ = (double *)malloc(sizeof(double) * retVal->GridDepth * 3);
-	retVal->hRPSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
-	retVal->hTPSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
-	retVal->hTFSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
-	retVal->hQFSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
-	retVal->hQSTARSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
+void ParticlePhilox4x32(const unsigned int *counter, const unsigned int *key, unsigned int *result) {
+	GPUPhilox4x32(counter, key, result);
+}
 
-	memset(retVal->hPartCount, 0.0, sizeof(double) * retVal->GridDepth);
-	memset(retVal->hVPSum, 0.0, sizeof(double) * retVal->GridDepth * 3);
-	memset(retVal->hVPSumSQ, 0.0, sizeof(double) * retVal->GridDepth * 3);
-	memset(retVal->hTPSum, 0.0, sizeof(double) * retVal->GridDepth);
-	memset(retVal->hRPSum, 0.0, sizeof(double) * retVal->GridDepth);
-	memset(retVal->hTFSum, 0.0, sizeof(double) * retVal->GridDepth);
-	memset(retVal->hQFSum, 0.0, sizeof(double) * retVal->GridDepth);
-	memset(retVal->hQSTARSum, 0.0, sizeof(double) * retVal->GridDepth);
+// Particle Storage
+size_t ParticleArrayStride(const size_t count) {
+	const size_t alignment = 64;
+	const size_t bytes = MAX(count, (size_t)1) * sizeof(double);
+	return ((bytes + alignment - 1) / alignment) * alignment;
+}
 
-#ifdef BUILD_CUDA
-	retVal->mDevices = (Device *)malloc(sizeof(Device) * gpudevices());
+void ParticleArrayBind(ParticleArray *array, char *data, const size_t count) {
+	array->Data = data;
+	array->Stride = ParticleArrayStride(count);
+
+	array->pidx = (int *)ParticleArrayComponent(array, 0);
+	array->procidx = (int *)ParticleArrayComponent(array, 1);
+	for(int j = 0; j < 3; j++) {
+		array->vp[j] = (double *)ParticleArrayComponent(array, 2 + j);
+		array->xp[j] = (double *)ParticleArrayComponent(array, 5 + j);
+		array->uf[j] = (double *)ParticleArrayComponent(array, 8 + j);
+		array->xrhs[j] = (double *)ParticleArrayComponent(array, 11 + j);
+		array->vrhs[j] = (double *)ParticleArrayComponent(array, 14 + j);
+	}
+	array->Tp = (double *)ParticleArrayComponent(array, 17);
+	array->Tprhs_s = (double *)ParticleArrayComponent(array, 18);
+	array->Tprhs_L = (double *)ParticleArrayComponent(array, 19);
+	array->Tf = (double *)ParticleArrayComponent(array, 20);
+	array->radius = (double *)ParticleArrayComponent(array, 21);
+	array->radrhs = (double *)ParticleArrayComponent(array, 22);
+	array->qinf = (double *)ParticleArrayComponent(array, 23);
+	array->qstar = (double *)ParticleArrayComponent(array, 24);
+	array->level[0] = (int *)ParticleArrayComponent(array, 25);
+	array->level[1] = (int *)ParticleArrayComponent(array, 26);
+}
 
-	unsigned int offset = 0;
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(retVal, i);
-		Device *dev = GetDeviceMemory(retVal);
-
-		dev->ParticleOffset = offset;
-		dev->ParticleCount = retVal->pCount / gpudevices();
-		if(i == 0) {
-			dev->ParticleCount += retVal->pCount % gpudevices();
-		}
-		offset += dev->ParticleCount;
+void *ParticleArrayComponent(const ParticleArray *array, const int component) {
+	return array->Data + component * array->Stride;
+}
 
-		gpuErrchk(cudaStreamCreate(&dev->Stream));
+size_t ParticleComponentSize(const int component) {
+	return component < 2 || component > 24 ? sizeof(int) : sizeof(double);
+}
 
-		gpuErrchk(cudaMalloc((void **)&dev->Particles, sizeof(Particle) * dev->ParticleCount));
+void ParticleArrayGet(const ParticleArray *array, const int index, Particle *output) {
+	output->pidx = array->pidx[index];
+	output->procidx = array->procidx[index];
+	for(int j = 0; j < 3; j++) {
+		output->vp[j] = array->vp[j][index];
+		output->xp[j] = array->xp[j][index];
+		output->uf[j] = array->uf[j][index];
+		output->xrhs[j] = array->xrhs[j][index];
+		output->vrhs[j] = array->vrhs[j][index];
+	}
+	output->Tp = array->Tp[index];
+	output->Tprhs_s = array->Tprhs_s[index];
+	output->Tprhs_L = array->Tprhs_L[index];
+	output->Tf = array->Tf[index];
+	output->radius = array->radius[index];
+	output->radrhs = array->radrhs[index];
+	output->qinf = array->qinf[index];
+	output->qstar = array->qstar[index];
+}
 
-		gpuErrchk(cudaMalloc((void **)&dev->Uext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
-		gpuErrchk(cudaMallocHost((void **)&retVal->hUext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
+void ParticleArraySet(ParticleArray *array, const int index, const Particle *input) {
+	array->pidx[index] = input->pidx;
+	array->procidx[index] = input->procidx;
+	for(int j = 0; j < 3; j++) {
+		array->vp[j][index] = input->vp[j];
+		array->xp[j][index] = input->xp[j];
+		array->uf[j][index] = input->uf[j];
+		array->xrhs[j][index] = input->xrhs[j];
+		array->vrhs[j][index] = input->vrhs[j];
+	}
+	array->Tp[index] = input->Tp;
+	array->Tprhs_s[index] = input->Tprhs_s;
+	array->Tprhs_L[index] = input->Tprhs_L;
+	array->Tf[index] = input->Tf;
+	array->radius[index] = input->radius;
+	array->radrhs[index] = input->radrhs;
+	array->qinf[index] = input->qinf;
+	array->qstar[index] = input->qstar;
+}
 
-		gpuErrchk(cudaMalloc((void **)&dev->Vext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
-		gpuErrchk(cudaMallocHost((void **)&retVal->hVext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
+// Field Storage. Every layout fits in the capacity of the bricked layout,
+// which pads each dimension to a whole number of bricks.
+size_t FieldArrayCapacity(const int nx, const int ny, const int nz) {
+	const size_t bx = (nx + FieldBrick - 1) / FieldBrick, by = (ny + FieldBrick - 1) / FieldBrick, bz = (nz + FieldBrick - 1) / FieldBrick;
+	return bx * by * bz * FieldBrick * FieldBrick * FieldBrick;
+}
 
-		gpuErrchk(cudaMalloc((void **)&dev->Wext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
-		gpuErrchk(cudaMallocHost((void **)&retVal->hWext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
+void FieldArrayBind(fieldSize *data, const size_t capacity, fieldSize **u, fieldSize **v, fieldSize **w, fieldSize **t, fieldSize **q) {
+	*u = data;
+	*v = data + capacity;
+	*w = data + 2 * capacity;
+	*t = data + 3 * capacity;
+	*q = data + 4 * capacity;
+}
 
-		gpuErrchk(cudaMalloc((void **)&dev->Text, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
-		gpuErrchk(cudaMallocHost((void **)&retVal->hText, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
+// Vertical Grid
+LevelLocator LevelLocatorBuild(const double *levels, const int count) {
+	LevelLocator retVal;
 
-		gpuErrchk(cudaMalloc((void **)&dev->Qext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
-		gpuErrchk(cudaMallocHost((void **)&retVal->hQext, sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth));
+	// Size the bins to the finest spacing so that each bin holds at most one
+	// level, capped so that extreme stretching cannot blow up the table.
+	double spacing = 0.0;
+	for(int i = 1; i < count; i++) {
+		const double dz = levels[i] - levels[i - 1];
+		if(dz > 0.0 && (spacing == 0.0 || dz < spacing)) spacing = dz;
+	}
 
-		gpuErrchk(cudaMalloc((void **)&dev->Z, sizeof(double) * retVal->GridDepth));
-		gpuErrchk(cudaMallocHost((void **)&retVal->hZ, sizeof(double) * retVal->GridDepth));
-		memcpy(retVal->hZ, z, sizeof(double) * retVal->GridDepth);
+	const double extent = count > 1 ? levels[count - 1] - levels[0] : 0.0;
+	retVal.Bins = 1;
+	if(spacing > 0.0 && extent > 0.0) {
+		retVal.Bins = (int)MIN(ceil(extent / spacing), 16.0 * count) + 1;
+	}
+	retVal.Origin = count > 0 ? levels[0] : 0.0;
+	retVal.Scale = extent > 0.0 ? (retVal.Bins - 1) / extent : 0.0;
+
+	retVal.Index = (int *)malloc(sizeof(int) * retVal.Bins);
+	int k = -1;
+	for(int bin = 0; bin < retVal.Bins; bin++) {
+		const double start = retVal.Origin + (retVal.Scale > 0.0 ? bin / retVal.Scale : 0.0);
+		while(k + 1 < count && levels[k + 1] <= start) {
+			k++;
+		}
+		retVal.Index[bin] = k;
+	}
 
-		gpuErrchk(cudaMalloc((void **)&dev->ZZ, sizeof(double) * retVal->GridDepth));
-		gpuErrchk(cudaMallocHost((void **)&retVal->hZZ, sizeof(double) * retVal->GridDepth));
-		memcpy(retVal->hZZ, zz, sizeof(double) * retVal->GridDepth);
+	return retVal;
+}
 
-		gpuErrchk(cudaMemcpyAsync(dev->Z, z, sizeof(double) * retVal->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
-		gpuErrchk(cudaMemcpyAsync(dev->ZZ, zz, sizeof(double) * retVal->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
+// Inverse Lagrange denominators of every window of 2, 4 and 6 consecutive
+// levels, the stencils used by the sixth order interpolation. Windows that
+// would run past the top level are left zero.
+double *LagrangeDenominatorsBuild(const double *levels, const int count) {
+	const int size = 3 * 6 * count;
+	double *retVal = (double *)malloc(sizeof(double) * MAX(size, 1));
+	for(int i = 0; i < size; i++) {
+		retVal[i] = 0.0;
 	}
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(retVal, i);
-		Device *dev = GetDeviceMemory(retVal);
-		cudaStreamSynchronize(dev->Stream);
+	for(int nodes = 2; nodes <= 6; nodes += 2) {
+		for(int first = 0; first + nodes <= count; first++) {
+			double *window = &retVal[LagrangeDenominatorIndex(count, first, nodes)];
+			for(int j = 0; j < nodes; j++) {
+				double denominator = 1.0;
+				for(int k = 0; k < nodes; k++) {
+					if(j != k) {
+						denominator = denominator * (levels[first + j] - levels[first + k]);
+					}
+				}
+				window[j] = 1.0 / denominator;
+			}
+		}
 	}
-#endif
-#else
-	retVal->hUext = (fieldSize *)malloc(sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth);
-	retVal->hVext = (fieldSize *)malloc(sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth);
-	retVal->hWext = (fieldSize *)malloc(sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth);
-	retVal->hText = (fieldSize *)malloc(sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth);
-	retVal->hQext = (fieldSize *)malloc(sizeof(fieldSize) * retVal->GridWidth * retVal->GridHeight * retVal->GridDepth);
+	return retVal;
+}
 
-	retVal->hZ = (double *)malloc(sizeof(double) * retVal->GridDepth);
-	memcpy(retVal->hZ, z, sizeof(double) * retVal->GridDepth);
+// Sixth order stencils of the levels of u, v, T and q (zz) or of w (z) for a
+// particle whose located level is k, stored at k + 1 for k in [-1, count).
+// Near the walls the stencil narrows to the levels in [First, Last) and the
+// remaining entries are clamped to the nearest valid level.
+LevelStencil *LevelStencilsBuild(const int count, const int wLevels) {
+	const int nnz = count;
+	LevelStencil *retVal = (LevelStencil *)malloc(sizeof(LevelStencil) * (count + 1));
+
+	for(int level = -1; level < count; level++) {
+		int *kpts = retVal[level + 1].kpts;
+		for(int j = 0; j < 6; j++) {
+			kpts[j] = level + j - 2;
+		}
 
-	retVal->hZZ = (double *)malloc(sizeof(double) * retVal->GridDepth);
-	memcpy(retVal->hZZ, zz, sizeof(double) * retVal->GridDepth);
-#endif
+		int first, last;
+		if(!wLevels) {
+			if(kpts[2] == 1) {
+				first = 2;
+				last = 4;
+				kpts[0] = 0;
+				kpts[1] = 0;
+			} else if(kpts[2] == 0) {
+				first = 3;
+				last = 5;
+				kpts[0] = 0;
+				kpts[1] = 0;
+				kpts[2] = 0;
+			} else if(kpts[2] < 0) {
+				first = 0;
+				last = 0;
+				kpts[0] = 0;
+				kpts[1] = 0;
+				kpts[2] = 0;
+			} else if(kpts[2] == 2) {
+				first = 1;
+				last = 5;
+			} else if(kpts[2] == nnz - 2) {
+				first = 1;
+				last = 3;
+				kpts[3] = nnz - 2;
+				kpts[4] = nnz - 2;
+				kpts[5] = nnz - 2;
+			} else if(kpts[2] > nnz - 2) {
+				first = 0;
+				last = 0;
+				kpts[3] = nnz - 2;
+				kpts[4] = nnz - 2;
+				kpts[5] = nnz - 2;
+			} else if(kpts[2] == nnz - 3) {
+				first = 2;
+				last = 4;
+				kpts[4] = nnz - 2;
+				kpts[5] = nnz - 2;
+			} else if(kpts[2] == nnz - 4) {
+				first = 1;
+				last = 5;
+			} else {
+				first = 0;
+				last = 6;
+			}
+		} else {
+			if(kpts[2] == 0) {
+				first = 2;
+				last = 4;
+				kpts[0] = 0;
+				kpts[1] = 0;
+			} else if(kpts[2] < 0) {
+				first = 0;
+				last = 0;
+				kpts[0] = 0;
+				kpts[1] = 0;
+				kpts[2] = 0;
+			} else if(kpts[2] == 1) {
+				first = 1;
+				last = 5;
+				kpts[0] = 0;
+			} else if(kpts[2] >= nnz - 2) {
+				first = 0;
+				last = 0;
+				kpts[3] = nnz - 2;
+				kpts[4] = nnz - 2;
+				kpts[5] = nnz - 2;
+			} else if(kpts[2] == nnz - 3) {
+				first = 2;
+				last = 4;
+				kpts[4] = nnz - 2;
+				kpts[5] = nnz - 2;
+			} else if(kpts[2] == nnz - 4) {
+				first = 1;
+				last = 5;
+				kpts[0] = 0;
+			} else {
+				first = 0;
+				last = 6;
+			}
+		}
 
-	SetParameters(retVal, params);
+		// Below the first level the unused nodes still index the field, so keep
+		// them inside it
+		for(int j = 0; j < 6; j++) {
+			kpts[j] = MAX(kpts[j], 0);
+		}
 
+		retVal[level + 1].First = first;
+		retVal[level + 1].Last = last;
+		retVal[level + 1].Window = first < last ? LagrangeDenominatorIndex(count, kpts[first], last - first) : 0;
+	}
 	return retVal;
 }
 
-extern "C" void ParticleFieldSet(GPU *gpu, fieldSize *uext, fieldSize *vext, fieldSize *wext, fieldSize *text, fieldSize *qext) {
-#ifdef BUILD_VERIFY_NAN
-	std::cout << "Testing for NAN in field:" << std::endl;
-	for(int i = 0; i < gpu->GridWidth * gpu->GridHeight * gpu->GridDepth; i++) {
-		if(isnan(uext[i])) std::cerr << "UEXT NAN found at index " << i << std::endl;
-		if(isnan(vext[i])) std::cerr << "VEXT NAN found at index " << i << std::endl;
-		if(isnan(wext[i])) std::cerr << "WEXT NAN found at index " << i << std::endl;
-		if(isnan(text[i])) std::cerr << "TEXT NAN found at index " << i << std::endl;
-		if(isnan(qext[i])) std::cerr << "QEXT NAN found at index " << i << std::endl;
-	}
-	std::cout << "\tComplete" << std::endl;
-#endif // BUILD_VERIFY_NAN
+int LevelLocate(const LevelLocator locator, const double *levels, const int count, const double position) {
+	return GPULevelLocate(locator, levels, count, position);
+}
 
-	memcpy(gpu->hUext, uext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
-	memcpy(gpu->hVext, vext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
-	memcpy(gpu->hWext, wext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
-	memcpy(gpu->hText, text, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
-	memcpy(gpu->hQext, qext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
+void SetDeviceIndex(GPU *gpu, const unsigned int index) {
+#ifdef BUILD_CUDA
+	if(gpu->cDevice != index) {
+		gpu->cDevice = index;
+		gpuErrchk(cudaSetDevice(gpu->cDevice));
+	}
+#endif
+}
 
+Device *GetDeviceMemory(GPU *gpu) {
 #ifdef BUILD_CUDA
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
+	return &gpu->mDevices[gpu->cDevice];
+#else
+	return nullptr;
+#endif
+}
 
-		gpuErrchk(cudaMemcpyAsync(dev->Uext, gpu->hUext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
-		gpuErrchk(cudaMemcpyAsync(dev->Vext, gpu->hVext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
-		gpuErrchk(cudaMemcpyAsync(dev->Wext, gpu->hWext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
-		gpuErrchk(cudaMemcpyAsync(dev->Text, gpu->hText, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
-		gpuErrchk(cudaMemcpyAsync(dev->Qext, gpu->hQext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
-	}
+// Kernel Timers. Entry points bracket their work with TimerStart and
+// TimerStop; while the registry is disabled TimerStart returns -1 without
+// reading the clock and TimerStop returns at once. On CUDA builds
+// TimerSynchronize waits for the streams so that a timer covers the kernels
+// rather than their launch. Timers are enabled from the start by
+// BUILD_PERFORMANCE_PROFILE and otherwise by ParticleTimersEnable.
+struct KernelTimer {
+	long long Calls;
+	double Total, Min, Max, Particles, Bytes;
+	long long Histogram[TimerBuckets];
+	double Counters[CounterCount];
+};
 
 #ifdef BUILD_PERFORMANCE_PROFILE
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
-		cudaStreamSynchronize(dev->Stream);
-	}
-#endif
+static std::atomic<int> TimersOn(1);
+#else
+static std::atomic<int> TimersOn(0);
 #endif
-}
+static KernelTimer Timers[TimerCount];
 
-extern "C" void ParticleAdd(GPU *gpu, const int position, const Particle *input) {
-	assert(position >= 0 && position < gpu->pCount);
-	memcpy(&gpu->hParticles[position], input, sizeof(Particle));
-}
+const char *TimerNames[TimerCount] = {"Sort", "Interpolate", "Step", "NonPeriodic", "Periodic", "Advance", "Statistics", "FieldSet", "Upload", "Download", "Checkpoint", "CheckpointSnapshot", "CheckpointWrite", "CheckpointBlocked", "TileCheckpoint", "SnapshotEncode", "SnapshotDecode", "TrajectoryRecord"};
 
-extern "C" Particle ParticleGet(GPU *gpu, const int position) {
-	assert(position >= 0 && position < gpu->pCount);
-	return gpu->hParticles[position];
-}
+// Particle bytes read and written per particle by each kernel, counted from
+// the components it touches
+const double InterpolateBytes = 80.0, StepBytes = 320.0, NonPeriodicBytes = 8.0, PeriodicBytes = 16.0, StatisticsBytes = 72.0;
 
-extern "C" void ParticleUpload(GPU *gpu) {
-#ifdef BUILD_CUDA
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
-		gpuErrchk(cudaMemcpyAsync(dev->Particles, &gpu->hParticles[dev->ParticleOffset], sizeof(Particle) * dev->ParticleCount, cudaMemcpyHostToDevice, dev->Stream));
+double ParticleRecordBytes() {
+	size_t bytes = 0;
+	for(int c = 0; c < ParticleComponents; c++) {
+		bytes += ParticleComponentSize(c);
 	}
+	return (double)bytes;
+}
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
-		cudaStreamSynchronize(dev->Stream);
+// Hardware Counters. Each thread of the host kernels counts cycles,
+// instructions, last level cache, dTLB and branch misses in user space into
+// its own perf_event group, opened by ParticleCountersEnable from the threads
+// of an OpenMP team of the GPU's size; TimerStart and TimerStop read and sum
+// every group. Counters the kernel or the machine do not provide, as under
+// most virtual machines, are left out and the rest are still counted. CUDA
+// builds count the host side of the entry points only.
+struct CounterGroup {
+	int Count;
+	int Fds[CounterCount], Counters[CounterCount];
+};
+
+static std::atomic<int> CountersOn(0);
+static std::vector<CounterGroup> CounterGroups;
+static int CounterAvailable[CounterCount];
+
+const char *CounterNames[CounterCount] = {"cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"};
+
+#ifdef __linux__
+// Opens the counter into group, or as the disabled leader of a new group
+int CounterOpen(const int counter, const int group) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(perf_event_attr));
+	attr.size = sizeof(perf_event_attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	switch(counter) {
+		case COUNTER_CYCLES:
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case COUNTER_INSTRUCTIONS:
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case COUNTER_LLC_MISSES:
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+		case COUNTER_DTLB_MISSES:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case COUNTER_BRANCH_MISSES:
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
 	}
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
 #endif
+
+// Counters of the calling thread, skipping those that fail to open
+CounterGroup CounterGroupOpen() {
+	CounterGroup group;
+	group.Count = 0;
+#ifdef __linux__
+	for(int counter = 0; counter < CounterCount; counter++) {
+		const int fd = CounterOpen(counter, group.Count > 0 ? group.Fds[0] : -1);
+		if(fd < 0) continue;
+		group.Fds[group.Count] = fd;
+		group.Counters[group.Count] = counter;
+		group.Count++;
+	}
+	if(group.Count > 0) ioctl(group.Fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
 #endif
+	return group;
 }
 
-extern "C" void ParticleGenerate(GPU *gpu, const int processors, const int ncpus, const int seed, const double temperature, const double radius, const double qinfp) {
-	const int particles_per_processor = gpu->pCount / processors;
-	const int particles_remaining = gpu->pCount % processors;
-	const double x_grid_change = gpu->FieldWidth / (double)ncpus, y_grid_change = gpu->FieldHeight / (double)ncpus;
-
-	double xMin = 0.0, xMax = x_grid_change;
-	double yMin = 0.0, yMax = y_grid_change;
-
-	memset(gpu->hParticles, 0, sizeof(Particle) * gpu->pCount);
+void CounterGroupClose(const CounterGroup &group) {
+	for(int i = 0; i < group.Count; i++) {
+		close(group.Fds[i]);
+	}
+}
 
-	int offset = 0;
-	for(size_t processor = 0; processor < processors; processor++) {
-		int particles = particles_per_processor;
-		if(processor == 0) particles += particles_remaining;
+// Sums the groups, scaled up while the kernel multiplexed them
+void CountersRead(double *values) {
+	for(int counter = 0; counter < CounterCount; counter++) {
+		values[counter] = 0.0;
+	}
 
-		if(processor != 0 && processor % ncpus == 0) {
-			xMin += x_grid_change;
-			xMax += x_grid_change;
+	for(size_t g = 0; g < CounterGroups.size(); g++) {
+		const CounterGroup &group = CounterGroups[g];
+		unsigned long long data[3 + CounterCount];
+		if(read(group.Fds[0], data, sizeof(data)) <= 0 || data[2] == 0) continue;
 
-			yMin = 0.0;
-			yMax = y_grid_change;
+		const double scale = (double)data[1] / (double)data[2];
+		for(unsigned long long i = 0; i < MIN(data[0], (unsigned long long)group.Count); i++) {
+			values[group.Counters[i]] += scale * (double)data[3 + i];
 		}
+	}
+}
 
-		rand2_seed(seed);
+// Clock and counters at TimerStart. Clock is -1 while the timers are disabled.
+struct TimerMark {
+	double Clock;
+	int Counted;
+	double Counters[CounterCount];
+};
+
+TimerMark TimerStart() {
+	TimerMark mark;
+	mark.Clock = -1.0;
+	mark.Counted = 0;
+	if(!TimersOn.load(std::memory_order_relaxed)) return mark;
+
+	if(CountersOn.load(std::memory_order_relaxed)) {
+		CountersRead(mark.Counters);
+		mark.Counted = 1;
+	}
+	mark.Clock = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	return mark;
+}
 
-		for(size_t i = 0; i < particles; i++) {
-			gpu->hParticles[offset].pidx = processor * gpu->pCount + (i + 1);
-			gpu->hParticles[offset].xp[0] = rand2() * (xMax - xMin) + xMin;
-			gpu->hParticles[offset].xp[1] = rand2() * (yMax - yMin) + yMin;
-			gpu->hParticles[offset].xp[2] = rand2() * (gpu->FieldDepth - 2.0 * radius) + radius;
-			gpu->hParticles[offset].Tp = temperature;
-			gpu->hParticles[offset].radius = radius;
-			gpu->hParticles[offset].qinf = qinfp;
+// Trace. While enabled, TimerRecord and ParticleRegionRecord append one
+// complete event, begin and end, for each kernel and region of the sampled
+// steps to a buffer of fixed capacity, from any thread; events past the
+// capacity are dropped and counted. Each rank's buffer is formatted by
+// ParticleTraceEvents and the ranks are merged by ParticleTraceWrite into a
+// Chrome trace_event file. Times count from ParticleTraceEnable, which the
+// ranks call together.
+struct TraceEvent {
+	int Name, Thread;
+	double Begin, End;
+};
+
+static std::atomic<int> TraceOn(0), TraceSampled(0), TraceThreads(0);
+static std::vector<TraceEvent> TraceBuffer;
+static std::atomic<size_t> TraceCount(0);
+static std::atomic<long long> TraceDropped(0);
+static double TraceOrigin;
+static int TraceRank, TraceSampling;
+
+int TraceThread() {
+	thread_local const int thread = TraceThreads.fetch_add(1);
+	return thread;
+}
 
-			offset++;
-		}
+// Names below TimerCount are kernel timers, the rest regions
+void TraceRecord(const int name, const double seconds) {
+	if(!TraceOn.load(std::memory_order_relaxed) || !TraceSampled.load(std::memory_order_relaxed)) return;
 
-		yMin += y_grid_change;
-		yMax += y_grid_change;
+	const size_t index = TraceCount.fetch_add(1, std::memory_order_relaxed);
+	if(index >= TraceBuffer.size()) {
+		TraceDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
 	}
 
-	ParticleUpload(gpu);
+	const double end = ParticleTimerClock() - TraceOrigin;
+	TraceBuffer[index] = {name, TraceThread(), end - seconds, end};
 }
 
-extern "C" void ParticleInterpolate(GPU *gpu, const double dx, const double dy) {
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto start = std::chrono::steady_clock::now();
-#endif
+void TimerRecord(const int timer, const double seconds, const double particles, const double bytes) {
+	TraceRecord(timer, seconds);
 
-#ifdef BUILD_CUDA
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
+	KernelTimer *entry = &Timers[timer];
+	entry->Min = entry->Calls == 0 ? seconds : MIN(entry->Min, seconds);
+	entry->Max = entry->Calls == 0 ? seconds : MAX(entry->Max, seconds);
+	entry->Calls++;
+	entry->Total += seconds;
+	entry->Particles += particles;
+	entry->Bytes += bytes;
 
-		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
-		if(gpu->mParameters.LinearInterpolation == 1) {
-			GPUFieldInterpolateLinear<<<blocks, CUDA_BLOCK_THREADS, ((gpu->GridDepth * 2) + 2) * sizeof(double), dev->Stream>>>(gpu->GridWidth, gpu->GridHeight, dx, dy, gpu->GridDepth, dev->Z, dev->ZZ, dev->Uext, dev->Vext, dev->Wext, dev->Text, dev->Qext, dev->ParticleCount, dev->Particles);
-		} else {
-			GPUFieldInterpolate<<<blocks, CUDA_BLOCK_THREADS, gpu->GridDepth * 2 * sizeof(double), dev->Stream>>>(gpu->GridWidth, gpu->GridHeight, dx, dy, gpu->GridDepth, dev->Z, dev->ZZ, dev->Uext, dev->Vext, dev->Wext, dev->Text, dev->Qext, dev->ParticleCount, dev->Particles);
+	const double us = seconds * 1.0e6;
+	const int bucket = us < 1.0 ? 0 : MIN(ilogb(us) + 1, TimerBuckets - 1);
+	entry->Histogram[bucket]++;
+}
+
+void TimerStop(const int timer, const TimerMark &start, const double particles, const double bytes) {
+	if(start.Clock < 0.0 || !TimersOn.load(std::memory_order_relaxed)) return;
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count() - start.Clock;
+
+	if(start.Counted && CountersOn.load(std::memory_order_relaxed)) {
+		double counters[CounterCount];
+		CountersRead(counters);
+		for(int counter = 0; counter < CounterCount; counter++) {
+			Timers[timer].Counters[counter] += counters[counter] - start.Counters[counter];
 		}
-		gpuErrchk(cudaPeekAtLastError());
 	}
+	TimerRecord(timer, seconds, particles, bytes);
+}
 
-#ifdef BUILD_PERFORMANCE_PROFILE
+void TimerSynchronize(GPU *gpu) {
+#ifdef BUILD_CUDA
+	if(!TimersOn.load(std::memory_order_relaxed)) return;
 	for(size_t i = 0; i < gpudevices(); i++) {
 		SetDeviceIndex(gpu, i);
 		Device *dev = GetDeviceMemory(gpu);
 		cudaStreamSynchronize(dev->Stream);
 	}
 #endif
-#else
-	if(gpu->mParameters.LinearInterpolation == 1) {
-		GPUFieldInterpolateLinear(gpu->GridWidth, gpu->GridHeight, dx, dy, gpu->GridDepth, gpu->hZ, gpu->hZZ, gpu->hUext, gpu->hVext, gpu->hWext, gpu->hText, gpu->hQext, gpu->pCount, gpu->hParticles);
-	} else {
-		GPUFieldInterpolate(gpu->GridWidth, gpu->GridHeight, dx, dy, gpu->GridDepth, gpu->hZ, gpu->hZZ, gpu->hUext, gpu->hVext, gpu->hWext, gpu->hText, gpu->hQext, gpu->pCount, gpu->hParticles);
-	}
-#endif
+}
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto end = std::chrono::steady_clock::now();
-	std::cout << "GPU Interpolate: " << std::chrono::duration<double>(end - start).count() << "s" << std::endl;
-#endif
+extern "C" void ParticleTimersEnable(const int enabled) {
+	TimersOn.store(enabled != 0);
 }
 
-extern "C" void ParticleStep(GPU *gpu, const int it, const int istage, const double dt) {
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto start = std::chrono::steady_clock::now();
-#endif
+extern "C" int ParticleTimersEnabled() {
+	return TimersOn.load();
+}
 
-#ifdef BUILD_CUDA
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
+extern "C" void ParticleTimersReset() {
+	memset(Timers, 0, sizeof(Timers));
+}
 
-		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
-		GPUUpdateParticles<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(it, istage - 1, dt, dev->ParticleCount, dev->Particles);
-		gpuErrchk(cudaPeekAtLastError());
+extern "C" const char *ParticleTimerName(const int timer) {
+	return timer >= 0 && timer < TimerCount ? TimerNames[timer] : nullptr;
+}
+
+// Returns -1 for an unknown timer
+extern "C" int ParticleTimersGet(const int timer, double *values) {
+	if(timer < 0 || timer >= TimerCount) return -1;
+
+	const KernelTimer *entry = &Timers[timer];
+	values[0] = (double)entry->Calls;
+	values[1] = entry->Total;
+	values[2] = entry->Min;
+	values[3] = entry->Max;
+	values[4] = entry->Particles;
+	values[5] = entry->Bytes;
+	for(int b = 0; b < TimerBuckets; b++) {
+		values[6 + b] = (double)entry->Histogram[b];
+	}
+	return 0;
+}
+
+// Opens a counter group on every thread of the GPU's OpenMP team, or closes
+// them. Returns the number of counters available, 0 if there are none.
+extern "C" int ParticleCountersEnable(const GPU *gpu, const int enabled) {
+	CountersOn.store(0);
+	for(size_t g = 0; g < CounterGroups.size(); g++) {
+		CounterGroupClose(CounterGroups[g]);
+	}
+	CounterGroups.clear();
+	if(!enabled) return 0;
+
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		const CounterGroup group = CounterGroupOpen();
+#pragma omp critical
+		{
+			if(group.Count > 0) CounterGroups.push_back(group);
+		}
 	}
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
-		cudaStreamSynchronize(dev->Stream);
+	// A counter is reported when every thread has it
+	int available = 0;
+	for(int counter = 0; counter < CounterCount; counter++) {
+		int threads = 0;
+		for(size_t g = 0; g < CounterGroups.size(); g++) {
+			for(int i = 0; i < CounterGroups[g].Count; i++) {
+				if(CounterGroups[g].Counters[i] == counter) threads++;
+			}
+		}
+		CounterAvailable[counter] = threads > 0 && threads == HostThreads(gpu);
+		available += CounterAvailable[counter];
 	}
-#endif
-#else
-	GPUUpdateParticles(it, istage - 1, dt, gpu->pCount, gpu->hParticles);
-#endif
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto end = std::chrono::steady_clock::now();
-	std::cout << "GPU Step: " << std::chrono::duration<double>(end - start).count() << "s" << std::endl;
-#endif
+	if(available == 0) {
+		fprintf(stderr, "ParticleCountersEnable: hardware counters are unavailable\n");
+		for(size_t g = 0; g < CounterGroups.size(); g++) {
+			CounterGroupClose(CounterGroups[g]);
+		}
+		CounterGroups.clear();
+		return 0;
+	}
+	CountersOn.store(1);
+	return available;
 }
 
-extern "C" void ParticleUpdateNonPeriodic(GPU *gpu) {
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto start = std::chrono::steady_clock::now();
-#endif
+extern "C" const char *ParticleCounterName(const int counter) {
+	return counter >= 0 && counter < CounterCount ? CounterNames[counter] : nullptr;
+}
 
-#ifdef BUILD_CUDA
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
+// Returns -1 for an unknown timer
+extern "C" int ParticleCountersGet(const int timer, double *values) {
+	if(timer < 0 || timer >= TimerCount) return -1;
 
-		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
-		GPUUpdateNonperiodic<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(gpu->FieldWidth, gpu->FieldHeight, gpu->FieldDepth, dev->ParticleCount, dev->Particles);
-		gpuErrchk(cudaPeekAtLastError());
+	for(int counter = 0; counter < CounterCount; counter++) {
+		values[counter] = CounterAvailable[counter] ? Timers[timer].Counters[counter] : -1.0;
 	}
+	return 0;
+}
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
-		cudaStreamSynchronize(dev->Stream);
+int CountersAvailable() {
+	int available = 0;
+	for(int counter = 0; counter < CounterCount; counter++) {
+		available += CounterAvailable[counter];
 	}
-#endif
-#else
-	GPUUpdateNonperiodic(gpu->FieldWidth, gpu->FieldHeight, gpu->FieldDepth, gpu->pCount, gpu->hParticles);
-#endif
-
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto end = std::chrono::steady_clock::now();
-	std::cout << "GPU NonPeriodic: " << std::chrono::duration<double>(end - start).count() << "s" << std::endl;
-#endif
+	return available;
 }
 
-extern "C" void ParticleUpdatePeriodic(GPU *gpu) {
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto start = std::chrono::steady_clock::now();
-#endif
+// Reports go to stdout when path is empty
+FILE *TimersOpen(const char *path) {
+	if(path == nullptr || path[0] == '\0') return stdout;
 
-#ifdef BUILD_CUDA
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
+	FILE *file = fopen(path, "w");
+	if(file == nullptr) fprintf(stderr, "ParticleTimers: cannot open %s\n", path);
+	return file;
+}
 
-		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
-		GPUUpdatePeriodic<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(gpu->FieldWidth, gpu->FieldHeight, dev->ParticleCount, dev->Particles);
-		gpuErrchk(cudaPeekAtLastError());
+int TimersClose(FILE *file) {
+	if(file == stdout) return fflush(file) == 0 ? 0 : -1;
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+// Writes the timers that were called. The table adds throughput in particles
+// and bytes per second, and a second table the hardware counters per call.
+// Returns 0 on success.
+extern "C" int ParticleTimersWrite(const char *path, const int format) {
+	FILE *file = TimersOpen(path);
+	if(file == nullptr) return -1;
+
+	const int counters = CountersAvailable();
+
+	if(format == TIMERS_JSON) {
+		fprintf(file, "{\"buckets_us\": \"0: <1, b: [2^(b-1), 2^b)\", \"timers\": [");
+	} else if(format == TIMERS_CSV) {
+		fprintf(file, "name,calls,total_s,min_s,max_s,particles,bytes");
+		for(int b = 0; b < TimerBuckets; b++) {
+			fprintf(file, ",bucket%d", b);
+		}
+		for(int counter = 0; counter < CounterCount; counter++) {
+			if(CounterAvailable[counter]) fprintf(file, ",%s", CounterNames[counter]);
+		}
+		fprintf(file, "\n");
+	} else {
+		fprintf(file, "%-20s %10s %14s %14s %14s %14s %12s %12s\n", "timer", "calls", "total_s", "mean_s", "min_s", "max_s", "Mpart/s", "GB/s");
 	}
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	for(size_t i = 0; i < gpudevices(); i++) {
-		SetDeviceIndex(gpu, i);
-		Device *dev = GetDeviceMemory(gpu);
-		cudaStreamSynchronize(dev->Stream);
+	int written = 0;
+	for(int timer = 0; timer < TimerCount; timer++) {
+		const KernelTimer *entry = &Timers[timer];
+		if(entry->Calls == 0) continue;
+
+		if(format == TIMERS_JSON) {
+			fprintf(file, "%s\n  {\"name\": \"%s\", \"calls\": %lld, \"total\": %.9e, \"min\": %.9e, \"max\": %.9e, \"particles\": %.17g, \"bytes\": %.17g, \"histogram\": [", written ? "," : "", TimerNames[timer], entry->Calls, entry->Total, entry->Min, entry->Max, entry->Particles, entry->Bytes);
+			for(int b = 0; b < TimerBuckets; b++) {
+				fprintf(file, "%s%lld", b ? ", " : "", entry->Histogram[b]);
+			}
+			fprintf(file, "]");
+			if(counters > 0) {
+				fprintf(file, ", \"counters\": {");
+				for(int counter = 0, first = 1; counter < CounterCount; counter++) {
+					if(!CounterAvailable[counter]) continue;
+					fprintf(file, "%s\"%s\": %.17g", first ? "" : ", ", CounterNames[counter], entry->Counters[counter]);
+					first = 0;
+				}
+				fprintf(file, "}");
+			}
+			fprintf(file, "}");
+		} else if(format == TIMERS_CSV) {
+			fprintf(file, "%s,%lld,%.9e,%.9e,%.9e,%.17g,%.17g", TimerNames[timer], entry->Calls, entry->Total, entry->Min, entry->Max, entry->Particles, entry->Bytes);
+			for(int b = 0; b < TimerBuckets; b++) {
+				fprintf(file, ",%lld", entry->Histogram[b]);
+			}
+			for(int counter = 0; counter < CounterCount; counter++) {
+				if(CounterAvailable[counter]) fprintf(file, ",%.17g", entry->Counters[counter]);
+			}
+			fprintf(file, "\n");
+		} else {
+			const double total = MAX(entry->Total, 1.0e-300);
+			fprintf(file, "%-20s %10lld %14.6e %14.6e %14.6e %14.6e %12.3f %12.3f\n", TimerNames[timer], entry->Calls, entry->Total, entry->Total / entry->Calls, entry->Min, entry->Max, entry->Particles / total * 1.0e-6, entry->Bytes / total * 1.0e-9);
+		}
+		written++;
 	}
-#endif
-#else
-	GPUUpdatePeriodic(gpu->FieldWidth, gpu->FieldHeight, gpu->pCount, gpu->hParticles);
-#endif
+	if(format == TIMERS_JSON) fprintf(file, "\n]}\n");
 
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto end = std::chrono::steady_clock::now();
-	std::cout << "GPU Periodic: " << std::chrono::duration<double>(end - start).count() << "s" << std::endl;
-#endif
+	if(format == TIMERS_TABLE && counters > 0) {
+		fprintf(file, "\n%-20s", "per call");
+		for(int counter = 0; counter < CounterCount; counter++) {
+			if(CounterAvailable[counter]) fprintf(file, " %14s", CounterNames[counter]);
+		}
+		const int ipc = CounterAvailable[COUNTER_CYCLES] && CounterAvailable[COUNTER_INSTRUCTIONS];
+		if(ipc) fprintf(file, " %8s", "IPC");
+		fprintf(file, "\n");
+
+		for(int timer = 0; timer < TimerCount; timer++) {
+			const KernelTimer *entry = &Timers[timer];
+			if(entry->Calls == 0) continue;
+
+			fprintf(file, "%-20s", TimerNames[timer]);
+			for(int counter = 0; counter < CounterCount; counter++) {
+				if(CounterAvailable[counter]) fprintf(file, " %14.6e", entry->Counters[counter] / entry->Calls);
+			}
+			if(ipc) fprintf(file, " %8.3f", entry->Counters[COUNTER_INSTRUCTIONS] / MAX(entry->Counters[COUNTER_CYCLES], 1.0));
+			fprintf(file, "\n");
+		}
+	}
+
+	// Share of the background checkpoint writes hidden behind the run
+	const KernelTimer *write = &Timers[TIMER_CHECKPOINT_WRITE], *blocked = &Timers[TIMER_CHECKPOINT_BLOCKED];
+	if(format == TIMERS_TABLE && write->Total > 0.0) {
+		fprintf(file, "Checkpoint overlap: %.1f%%\n", 100.0 * MAX(1.0 - blocked->Total / write->Total, 0.0));
+	}
+	return TimersClose(file);
 }
 
-extern "C" void ParticleCalculateStatistics(GPU *gpu, const double dx, const double dy) {
-#ifdef BUILD_PERFORMANCE_PROFILE
-	auto start = std::chrono::steady_clock::now();
+// Regions. Named timers of the calling code, such as the phases of the
+// Fortran time step, recorded without synchronisation on every rank. Each
+// rank keeps its own totals; the caller reduces them across ranks and hands
+// the result to ParticleRegionsWrite. Ranks may time different regions, so
+// before a reduction every rank merges the names of all ranks (see
+// ParticleRegionsMerge), which gives each the same regions in RegionOrder.
+static std::vector<std::string> RegionNames;
+static std::vector<KernelTimer> Regions;
+static std::vector<int> RegionOrder;
+
+extern "C" double ParticleTimerClock() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int RegionFind(const char *name) {
+	for(size_t region = 0; region < RegionNames.size(); region++) {
+		if(RegionNames[region] == name) return (int)region;
+	}
+	return -1;
+}
+
+int RegionAdd(const char *name) {
+	KernelTimer timer;
+	memset(&timer, 0, sizeof(KernelTimer));
+	RegionNames.push_back(name);
+	Regions.push_back(timer);
+	return (int)Regions.size() - 1;
+}
+
+extern "C" int ParticleRegion(const char *name) {
+	const int region = RegionFind(name);
+	if(region >= 0) return region;
+
+	RegionOrder.push_back((int)Regions.size());
+	return RegionAdd(name);
+}
+
+extern "C" void ParticleRegionRecord(const int region, const double seconds) {
+	Regions[region].Calls++;
+	Regions[region].Total += seconds;
+	TraceRecord(TimerCount + region, seconds);
+}
+
+extern "C" int ParticleRegionCount() {
+	return (int)RegionOrder.size();
+}
+
+// Writes the null terminated region names into names when they fit in size
+// bytes. Returns the bytes needed.
+extern "C" int ParticleRegionNames(char *names, const int size) {
+	int needed = 0;
+	for(size_t region = 0; region < RegionNames.size(); region++) {
+		needed += (int)RegionNames[region].size() + 1;
+	}
+	if(needed > size) return needed;
+
+	char *name = names;
+	for(size_t region = 0; region < RegionNames.size(); region++) {
+		memcpy(name, RegionNames[region].c_str(), RegionNames[region].size() + 1);
+		name += RegionNames[region].size() + 1;
+	}
+	return needed;
+}
+
+// Registers the names of every rank, concatenated in rank order, and orders
+// the regions by their first appearance
+extern "C" void ParticleRegionsMerge(const char *names, const int size) {
+	RegionOrder.clear();
+	std::vector<char> listed;
+	for(int offset = 0; offset < size;) {
+		const char *name = names + offset;
+		const int length = (int)strnlen(name, size - offset);
+		if(length == size - offset) break;
+
+		int region = RegionFind(name);
+		if(region < 0) region = RegionAdd(name);
+		listed.resize(Regions.size(), 0);
+		if(!listed[region]) RegionOrder.push_back(region);
+		listed[region] = 1;
+		offset += length + 1;
+	}
+}
+
+// Calls and total seconds of the first count regions in RegionOrder
+extern "C" void ParticleRegionsGet(const int count, double *calls, double *totals) {
+	for(int n = 0; n < count && n < (int)RegionOrder.size(); n++) {
+		calls[n] = (double)Regions[RegionOrder[n]].Calls;
+		totals[n] = Regions[RegionOrder[n]].Total;
+	}
+}
+
+// Writes the per rank totals of the first count regions in RegionOrder
+// reduced over ranks; ranks that never enter a region count as zero.
+// Imbalance is max / mean - 1, the share of the mean the slowest rank adds.
+// Returns 0 on success.
+extern "C" int ParticleRegionsWrite(const char *path, const int format, const int ranks, const int count, const double *calls, const double *minimum, const double *mean, const double *maximum) {
+	FILE *file = TimersOpen(path);
+	if(file == nullptr) return -1;
+
+	if(format == TIMERS_JSON) {
+		fprintf(file, "{\"ranks\": %d, \"regions\": [", ranks);
+	} else if(format == TIMERS_CSV) {
+		fprintf(file, "name,calls,min_s,mean_s,max_s,imbalance\n");
+	} else {
+		fprintf(file, "%-20s %10s %14s %14s %14s %10s\n", "region", "calls", "min_s", "mean_s", "max_s", "imbalance");
+	}
+
+	for(int region = 0; region < count && region < (int)RegionOrder.size(); region++) {
+		const double imbalance = mean[region] > 0.0 ? maximum[region] / mean[region] - 1.0 : 0.0;
+		const char *name = RegionNames[RegionOrder[region]].c_str();
+		if(format == TIMERS_JSON) {
+			fprintf(file, "%s\n  {\"name\": \"%s\", \"calls\": %.0f, \"min\": %.9e, \"mean\": %.9e, \"max\": %.9e, \"imbalance\": %.6f}", region ? "," : "", name, calls[region], minimum[region], mean[region], maximum[region], imbalance);
+		} else if(format == TIMERS_CSV) {
+			fprintf(file, "%s,%.0f,%.9e,%.9e,%.9e,%.6f\n", name, calls[region], minimum[region], mean[region], maximum[region], imbalance);
+		} else {
+			fprintf(file, "%-20s %10.0f %14.6e %14.6e %14.6e %9.1f%%\n", name, calls[region], minimum[region], mean[region], maximum[region], 100.0 * imbalance);
+		}
+	}
+	if(format == TIMERS_JSON) fprintf(file, "\n]}\n");
+	return TimersClose(file);
+}
+
+// Starts a trace of capacity events, taking every sampling-th step from the
+// first (see ParticleTraceStep) and enabling the kernel timers. A capacity of
+// 0 stops tracing.
+extern "C" void ParticleTraceEnable(const int rank, const int capacity, const int sampling) {
+	TraceOn.store(0);
+	TraceBuffer.assign(MAX(capacity, 0), TraceEvent());
+	TraceCount.store(0);
+	TraceDropped.store(0);
+	TraceRank = rank;
+	TraceSampling = MAX(sampling, 1);
+	TraceOrigin = ParticleTimerClock();
+	if(capacity <= 0) return;
+
+	ParticleTimersEnable(1);
+	TraceSampled.store(1);
+	TraceOn.store(1);
+}
+
+// Called before step it; events are kept while it is a multiple of sampling
+extern "C" void ParticleTraceStep(const int it) {
+	TraceSampled.store(it % MAX(TraceSampling, 1) == 0);
+}
+
+extern "C" long long ParticleTraceDropped() {
+	return TraceDropped.load();
+}
+
+// Writes the events of this rank into events as trace_event objects, each
+// followed by a comma, preceded by the rank's name. Returns the bytes
+// needed, which are written only if they fit in size.
+extern "C" int ParticleTraceEvents(char *events, const int size) {
+	const size_t count = MIN(TraceCount.load(), TraceBuffer.size());
+	const long long dropped = TraceDropped.load();
+
+	std::string text;
+	char line[512];
+	snprintf(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d%s\"}},\n", TraceRank, TraceRank, dropped > 0 ? " (events dropped)" : "");
+	text += line;
+	if(dropped > 0) {
+		snprintf(line, sizeof(line), "{\"name\":\"dropped\",\"ph\":\"C\",\"pid\":%d,\"ts\":0,\"args\":{\"events\":%lld}},\n", TraceRank, dropped);
+		text += line;
+	}
+
+	for(size_t index = 0; index < count; index++) {
+		const TraceEvent &event = TraceBuffer[index];
+		const int region = event.Name - TimerCount;
+		const char *name = region < 0 ? TimerNames[event.Name] : RegionNames[region].c_str();
+		snprintf(line, sizeof(line), "{\"name\":\"%.200s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n", name, region < 0 ? "kernel" : "region", TraceRank, event.Thread, event.Begin * 1.0e6, (event.End - event.Begin) * 1.0e6);
+		text += line;
+	}
+
+	if(events != nullptr && (size_t)size >= text.size()) memcpy(events, text.data(), text.size());
+	return (int)text.size();
+}
+
+// Writes the events of every rank, as gathered from ParticleTraceEvents, to
+// a trace_event file. Returns 0 on success.
+extern "C" int ParticleTraceWrite(const char *path, const char *events, const long long size) {
+	FILE *file = fopen(path, "w");
+	if(file == nullptr) {
+		fprintf(stderr, "ParticleTraceWrite: cannot open %s\n", path);
+		return -1;
+	}
+
+	// The last event drops its comma
+	size_t length = MAX(size, 0LL);
+	while(length > 0 && (events[length - 1] == '\n' || events[length - 1] == ',')) {
+		length--;
+	}
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	const int written = fwrite(events, 1, length, file) == length;
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0 && written ? 0 : -1;
+}
+
+extern "C" GPU *NewGPU(const int particles, const int width, const int height, const int depth, const double fWidth, const double fHeight, const double fDepth, double *z, double *zz, const Parameters *params) {
+	GPU *retVal = (GPU *)malloc(sizeof(GPU));
+
+	// Particle Data
+	retVal->pCount = particles;
+	char *hParticleData = nullptr;
+#ifdef BUILD_CUDA
+	gpuErrchk(cudaMallocHost((void **)&hParticleData, ParticleComponents * ParticleArrayStride(particles)));
+#else
+	if(posix_memalign((void **)&hParticleData, 64, ParticleComponents * ParticleArrayStride(particles)) != 0) hParticleData = nullptr;
 #endif
-	memset(gpu->hPartCount, 0.0, sizeof(double) * gpu->GridDepth);
-	memset(gpu->hVPSum, 0.0, sizeof(double) * gpu->GridDepth * 3);
-	memset(gpu->hVPSumSQ, 0.0, sizeof(double) * gpu->GridDepth * 3);
-	memset(gpu->hRPSum, 0.0, sizeof(double) * gpu->GridDepth);
-	memset(gpu->hTPSum, 0.0, sizeof(double) * gpu->GridDepth);
-	memset(gpu->hTFSum, 0.0, sizeof(double) * gpu->GridDepth);
-	memset(gpu->hQFSum, 0.0, sizeof(double) * gpu->GridDepth);
-	memset(gpu->hQSTARSum, 0.0, sizeof(double) * gpu->GridDepth);
+	ParticleArrayBind(&retVal->hParticles, hParticleData, particles);
+
+	// Field Data
+	retVal->FieldWidth = fWidth;
+	retVal->FieldHeight = fHeight;
+	retVal->FieldDepth = fDepth;
+
+	// Grid Data
+	retVal->GridWidth = width;
+	retVal->GridHeight = height;
+	retVal->GridDepth = depth;
+	retVal->FieldLayout = FIELD_PLANAR;
+	retVal->FieldCapacity = FieldArrayCapacity(width, height, depth);
+
+	// Statistics
+	retVal->hPartCount = (double *)malloc(sizeof(double) * retVal->GridDepth);
+	retVal->hVPSum = (double *)malloc(sizeof(double) * retVal->GridDepth * 3);
+	retVal->hVPSumSQ = (double *)malloc(sizeof(double) * retVal->GridDepth * 3);
+	retVal->hRPSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
+	retVal->hTPSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
+	retVal->hTFSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
+	retVal->hQFSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
+	retVal->hQSTARSum = (double *)malloc(sizeof(double) * retVal->GridDepth);
+
+	memset(retVal->hPartCount, 0.0, sizeof(double) * retVal->GridDepth);
+	memset(retVal->hVPSum, 0.0, sizeof(double) * retVal->GridDepth * 3);
+	memset(retVal->hVPSumSQ, 0.0, sizeof(double) * retVal->GridDepth * 3);
+	memset(retVal->hTPSum, 0.0, sizeof(double) * retVal->GridDepth);
+	memset(retVal->hRPSum, 0.0, sizeof(double) * retVal->GridDepth);
+	memset(retVal->hTFSum, 0.0, sizeof(double) * retVal->GridDepth);
+	memset(retVal->hQFSum, 0.0, sizeof(double) * retVal->GridDepth);
+	memset(retVal->hQSTARSum, 0.0, sizeof(double) * retVal->GridDepth);
 
 #ifdef BUILD_CUDA
-	ParticleDownload(gpu);
+	retVal->mDevices = (Device *)malloc(sizeof(Device) * gpudevices());
+
+	unsigned int offset = 0;
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(retVal, i);
+		Device *dev = GetDeviceMemory(retVal);
+
+		dev->ParticleOffset = offset;
+		dev->ParticleCount = retVal->pCount / gpudevices();
+		if(i == 0) {
+			dev->ParticleCount += retVal->pCount % gpudevices();
+		}
+		offset += dev->ParticleCount;
+
+		gpuErrchk(cudaStreamCreate(&dev->Stream));
+
+		char *dParticleData = nullptr;
+		gpuErrchk(cudaMalloc((void **)&dParticleData, ParticleComponents * ParticleArrayStride(dev->ParticleCount)));
+		ParticleArrayBind(&dev->Particles, dParticleData, dev->ParticleCount);
+
+		fieldSize *dField = nullptr;
+		gpuErrchk(cudaMalloc((void **)&dField, sizeof(fieldSize) * 5 * retVal->FieldCapacity));
+		gpuErrchk(cudaMemset(dField, 0, sizeof(fieldSize) * 5 * retVal->FieldCapacity));
+		FieldArrayBind(dField, retVal->FieldCapacity, &dev->Uext, &dev->Vext, &dev->Wext, &dev->Text, &dev->Qext);
+		if(i == 0) {
+			fieldSize *hField = nullptr;
+			gpuErrchk(cudaMallocHost((void **)&hField, sizeof(fieldSize) * 5 * retVal->FieldCapacity));
+			memset(hField, 0, sizeof(fieldSize) * 5 * retVal->FieldCapacity);
+			FieldArrayBind(hField, retVal->FieldCapacity, &retVal->hUext, &retVal->hVext, &retVal->hWext, &retVal->hText, &retVal->hQext);
+		}
+
+		gpuErrchk(cudaMalloc((void **)&dev->Statistics, sizeof(double) * StatisticsSize(retVal->GridDepth)));
+
+		gpuErrchk(cudaMalloc((void **)&dev->Z, sizeof(double) * retVal->GridDepth));
+		gpuErrchk(cudaMallocHost((void **)&retVal->hZ, sizeof(double) * retVal->GridDepth));
+		memcpy(retVal->hZ, z, sizeof(double) * retVal->GridDepth);
+
+		gpuErrchk(cudaMalloc((void **)&dev->ZZ, sizeof(double) * retVal->GridDepth));
+		gpuErrchk(cudaMallocHost((void **)&retVal->hZZ, sizeof(double) * retVal->GridDepth));
+		memcpy(retVal->hZZ, zz, sizeof(double) * retVal->GridDepth);
+
+		gpuErrchk(cudaMemcpyAsync(dev->Z, z, sizeof(double) * retVal->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
+		gpuErrchk(cudaMemcpyAsync(dev->ZZ, zz, sizeof(double) * retVal->GridDepth, cudaMemcpyHostToDevice, dev->Stream));
+	}
+
+	TimerSynchronize(retVal);
+#else
+	fieldSize *hField = (fieldSize *)calloc(5 * retVal->FieldCapacity, sizeof(fieldSize));
+	FieldArrayBind(hField, retVal->FieldCapacity, &retVal->hUext, &retVal->hVext, &retVal->hWext, &retVal->hText, &retVal->hQext);
+
+	retVal->hZ = (double *)malloc(sizeof(double) * retVal->GridDepth);
+	memcpy(retVal->hZ, z, sizeof(double) * retVal->GridDepth);
+
+	retVal->hZZ = (double *)malloc(sizeof(double) * retVal->GridDepth);
+	memcpy(retVal->hZZ, zz, sizeof(double) * retVal->GridDepth);
 #endif
-	GPUCalculateStatistics(gpu->GridDepth, gpu->hZ, gpu->hPartCount, gpu->hVPSum, gpu->hVPSumSQ, gpu->hRPSum, gpu->hTPSum, gpu->hTFSum, gpu-> hQFSum, gpu-> hQSTARSum, gpu->pCount, gpu->hParticles, gpu-> part_stats);
 
-#ifdef BUILD_PERFORMANCE_PROFILE
+	// Vertical Locators
+	retVal->hZLocator = LevelLocatorBuild(retVal->hZ, retVal->GridDepth);
+	retVal->hZZLocator = LevelLocatorBuild(retVal->hZZ, retVal->GridDepth);
+
+	// Vertical Interpolation Denominators
+	retVal->hZDenominators = LagrangeDenominatorsBuild(retVal->hZ, retVal->GridDepth);
+	retVal->hZZDenominators = LagrangeDenominatorsBuild(retVal->hZZ, retVal->GridDepth);
+	retVal->hZStencils = LevelStencilsBuild(retVal->GridDepth, 1);
+	retVal->hZZStencils = LevelStencilsBuild(retVal->GridDepth, 0);
+
 #ifdef BUILD_CUDA
-	cudaDeviceSynchronize();
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(retVal, i);
+		Device *dev = GetDeviceMemory(retVal);
+
+		dev->ZLocator = retVal->hZLocator;
+		gpuErrchk(cudaMalloc((void **)&dev->ZLocator.Index, sizeof(int) * retVal->hZLocator.Bins));
+		gpuErrchk(cudaMemcpy(dev->ZLocator.Index, retVal->hZLocator.Index, sizeof(int) * retVal->hZLocator.Bins, cudaMemcpyHostToDevice));
+
+		dev->ZZLocator = retVal->hZZLocator;
+		gpuErrchk(cudaMalloc((void **)&dev->ZZLocator.Index, sizeof(int) * retVal->hZZLocator.Bins));
+		gpuErrchk(cudaMemcpy(dev->ZZLocator.Index, retVal->hZZLocator.Index, sizeof(int) * retVal->hZZLocator.Bins, cudaMemcpyHostToDevice));
+
+		const size_t denominators = sizeof(double) * 3 * 6 * retVal->GridDepth;
+		gpuErrchk(cudaMalloc((void **)&dev->ZDenominators, denominators));
+		gpuErrchk(cudaMemcpy(dev->ZDenominators, retVal->hZDenominators, denominators, cudaMemcpyHostToDevice));
+		gpuErrchk(cudaMalloc((void **)&dev->ZZDenominators, denominators));
+		gpuErrchk(cudaMemcpy(dev->ZZDenominators, retVal->hZZDenominators, denominators, cudaMemcpyHostToDevice));
+
+		const size_t stencils = sizeof(LevelStencil) * (retVal->GridDepth + 1);
+		gpuErrchk(cudaMalloc((void **)&dev->ZStencils, stencils));
+		gpuErrchk(cudaMemcpy(dev->ZStencils, retVal->hZStencils, stencils, cudaMemcpyHostToDevice));
+		gpuErrchk(cudaMalloc((void **)&dev->ZZStencils, stencils));
+		gpuErrchk(cudaMemcpy(dev->ZZStencils, retVal->hZZStencils, stencils, cudaMemcpyHostToDevice));
+	}
 #endif
-	auto end = std::chrono::steady_clock::now();
-	std::cout << "GPU Statistics: " << std::chrono::duration<double>(end - start).count() << "s" << std::endl;
+
+	// Host Threads
+	retVal->ThreadCount = 0;
+	retVal->SIMDLevel = -1;
+
+	// Particle Ordering
+	retVal->SortInterval = 0;
+	retVal->SortCounter = 0;
+	retVal->hSlot = (int *)malloc(sizeof(int) * MAX(particles, 1));
+	retVal->hPosition = (int *)malloc(sizeof(int) * MAX(particles, 1));
+	for(int i = 0; i < particles; i++) {
+		retVal->hSlot[i] = i;
+		retVal->hPosition[i] = i;
+	}
+
+	// Tracked Particles
+	retVal->ProbeCount = 0;
+	retVal->hProbeKey = nullptr;
+	retVal->hProbeOrder = nullptr;
+	retVal->hProbePosition = nullptr;
+	retVal->ProbeRecords = 0;
+	retVal->ProbeCapacity = 0;
+	retVal->hProbeSeries = nullptr;
+
+	// Background Checkpoints
+	retVal->Writer = nullptr;
+
+	// Trajectories
+	retVal->Trajectory = nullptr;
+
+	// Telemetry
+	retVal->Telemetry = nullptr;
+
+	// Statistics
+	retVal->StatisticsRequested = 0;
+	retVal->StatisticsReady = 0;
+	retVal->hStatistics = (double *)malloc(sizeof(double) * StatisticsSize(retVal->GridDepth));
+	StatisticsClear(retVal->GridDepth, retVal->hStatistics);
+
+	// Interpolation
+	retVal->StencilCache = 1;
+	retVal->StageInterpolation = 0;
+	retVal->InterpolationDx = 0.0;
+	retVal->InterpolationDy = 0.0;
+	for(int i = 0; i < particles; i++) {
+		retVal->hParticles.level[0][i] = -2;
+		retVal->hParticles.level[1][i] = -2;
+	}
+
+	SetParameters(retVal, params);
+
+	return retVal;
+}
+
+extern "C" void ParticleSetThreads(GPU *gpu, const int threads) {
+	gpu->ThreadCount = MAX(threads, 0);
+}
+
+extern "C" void ParticleSetSIMD(GPU *gpu, const int level) {
+	gpu->SIMDLevel = level < 0 ? -1 : MIN(level, (int)SIMD_AVX512);
+}
+
+extern "C" void ParticleSetStencilCache(GPU *gpu, const int enabled) {
+	gpu->StencilCache = enabled != 0;
+}
+
+extern "C" void ParticleSetStageInterpolation(GPU *gpu, const int enabled) {
+	gpu->StageInterpolation = enabled != 0;
+}
+
+extern "C" void ParticleRequestStatistics(GPU *gpu) {
+	gpu->StatisticsRequested = 1;
+}
+
+extern "C" void ParticleSetFieldLayout(GPU *gpu, const int layout) {
+	gpu->FieldLayout = (layout == FIELD_INTERLEAVED || layout == FIELD_BRICKED) ? layout : FIELD_PLANAR;
+}
+
+extern "C" void ParticleSetSortInterval(GPU *gpu, const int interval) {
+	gpu->SortInterval = MAX(interval, 0);
+	gpu->SortCounter = 0;
+}
+
+extern "C" void ParticleFieldSet(GPU *gpu, fieldSize *uext, fieldSize *vext, fieldSize *wext, fieldSize *text, fieldSize *qext) {
+	const TimerMark start = TimerStart();
+#ifdef BUILD_VERIFY_NAN
+	std::cout << "Testing for NAN in field:" << std::endl;
+	for(int i = 0; i < gpu->GridWidth * gpu->GridHeight * gpu->GridDepth; i++) {
+		if(isnan(uext[i])) std::cerr << "UEXT NAN found at index " << i << std::endl;
+		if(isnan(vext[i])) std::cerr << "VEXT NAN found at index " << i << std::endl;
+		if(isnan(wext[i])) std::cerr << "WEXT NAN found at index " << i << std::endl;
+		if(isnan(text[i])) std::cerr << "TEXT NAN found at index " << i << std::endl;
+		if(isnan(qext[i])) std::cerr << "QEXT NAN found at index " << i << std::endl;
+	}
+	std::cout << "\tComplete" << std::endl;
+#endif // BUILD_VERIFY_NAN
+
+	if(gpu->FieldLayout == FIELD_PLANAR) {
+		memcpy(gpu->hUext, uext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
+		memcpy(gpu->hVext, vext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
+		memcpy(gpu->hWext, wext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
+		memcpy(gpu->hText, text, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
+		memcpy(gpu->hQext, qext, sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
+	} else {
+		// Convert one x-y plane per iteration
+		const int nx = gpu->GridWidth, ny = gpu->GridHeight;
+		fieldSize *const fields[5] = {gpu->hUext, gpu->hVext, gpu->hWext, gpu->hText, gpu->hQext};
+		const InterleavedFieldView interleaved = FieldViewMake<InterleavedFieldView>(nx, ny, fields);
+		const BrickedFieldView bricked = FieldViewMake<BrickedFieldView>(nx, ny, fields);
+#pragma omp parallel num_threads(HostThreads(gpu))
+		{
+			int k_start, k_end;
+			HostKernelRange(gpu->GridDepth, &k_start, &k_end);
+			for(int k = k_start; k < k_end; k++) {
+				for(int j = 0; j < ny; j++) {
+					for(int i = 0; i < nx; i++) {
+						const int source = i + j * nx + k * ny * nx;
+						if(gpu->FieldLayout == FIELD_INTERLEAVED) {
+							fieldSize *node = gpu->hUext + interleaved.Index(i, j, k);
+							node[0] = uext[source];
+							node[1] = vext[source];
+							node[2] = wext[source];
+							node[3] = text[source];
+							node[4] = qext[source];
+						} else {
+							const int n = bricked.Index(i, j, k);
+							gpu->hUext[n] = uext[source];
+							gpu->hVext[n] = vext[source];
+							gpu->hWext[n] = wext[source];
+							gpu->hText[n] = text[source];
+							gpu->hQext[n] = qext[source];
+						}
+					}
+				}
+			}
+		}
+	}
+
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+
+		gpuErrchk(cudaMemcpyAsync(dev->Uext, gpu->hUext, sizeof(fieldSize) * 5 * gpu->FieldCapacity, cudaMemcpyHostToDevice, dev->Stream));
+	}
+
+	TimerSynchronize(gpu);
 #endif
+	TimerStop(TIMER_FIELD, start, 0, 2.0 * 5 * sizeof(fieldSize) * gpu->GridWidth * gpu->GridHeight * gpu->GridDepth);
 }
 
-extern "C" void ParticleDownload(GPU *gpu) {
+// Tracked Particles
+//
+// Probes are found through their (procidx, pidx) key in hProbeOrder and
+// remember the position of their particle, which the hSlot map carries
+// through every reordering. Lookups therefore cost O(k) and never scan the
+// particles; only ParticleTrack and the generators do.
+long long ProbeKey(const int procidx, const int pidx) {
+	return ((long long)procidx << 32) | (unsigned int)pidx;
+}
+
+// Probe with key, or -1
+int ProbeFind(const GPU *gpu, const long long key) {
+	int low = 0, high = gpu->ProbeCount - 1;
+	while(low <= high) {
+		const int mid = (low + high) / 2;
+		const long long value = gpu->hProbeKey[gpu->hProbeOrder[mid]];
+		if(value == key) return gpu->hProbeOrder[mid];
+		if(value < key) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return -1;
+}
+
+// The particle at position changes from key previous to key next
+void ProbeMove(GPU *gpu, const int position, const long long previous, const long long next) {
+	const int before = ProbeFind(gpu, previous);
+	if(before >= 0 && gpu->hProbePosition[before] == position) {
+		gpu->hProbePosition[before] = -1;
+	}
+	const int after = ProbeFind(gpu, next);
+	if(after >= 0) {
+		gpu->hProbePosition[after] = position;
+	}
+}
+
+void ProbeResolve(GPU *gpu) {
+	if(gpu->ProbeCount == 0) return;
+
+	for(int n = 0; n < gpu->ProbeCount; n++) {
+		gpu->hProbePosition[n] = -1;
+	}
+	for(int position = 0; position < (int)gpu->pCount; position++) {
+		const int slot = gpu->hSlot[position];
+		const int probe = ProbeFind(gpu, ProbeKey(gpu->hParticles.procidx[slot], gpu->hParticles.pidx[slot]));
+		if(probe >= 0) gpu->hProbePosition[probe] = position;
+	}
+}
+
+// Copies the particle in slot from wherever it currently lives
+void ParticleFetch(GPU *gpu, const int slot, Particle *output) {
 #ifdef BUILD_CUDA
+	alignas(64) char data[ParticleComponents * 64];
+	ParticleArray single;
+	ParticleArrayBind(&single, data, 1);
 	for(size_t i = 0; i < gpudevices(); i++) {
 		SetDeviceIndex(gpu, i);
 		Device *dev = GetDeviceMemory(gpu);
-		gpuErrchk(cudaMemcpy(&gpu->hParticles[dev->ParticleOffset], dev->Particles, sizeof(Particle) * dev->ParticleCount, cudaMemcpyDeviceToHost));
+		if(slot < dev->ParticleOffset || slot >= dev->ParticleOffset + dev->ParticleCount) continue;
+
+		for(int c = 0; c < ParticleComponents; c++) {
+			const size_t size = ParticleComponentSize(c);
+			gpuErrchk(cudaMemcpy(ParticleArrayComponent(&single, c), (char *)ParticleArrayComponent(&dev->Particles, c) + (slot - dev->ParticleOffset) * size, size, cudaMemcpyDeviceToHost));
+		}
 	}
+	ParticleArrayGet(&single, 0, output);
+#else
+	ParticleArrayGet(&gpu->hParticles, slot, output);
 #endif
 }
 
+// Position, velocity, fluid velocity, radius, Tp, Tf, qinf and qstar, the
+// order of part_stats[3..16]
+void ProbeSample(const Particle *particle, double *sample) {
+	for(int j = 0; j < 3; j++) {
+		sample[0 + j] = particle->xp[j];
+		sample[3 + j] = particle->vp[j];
+		sample[6 + j] = particle->uf[j];
+	}
+	sample[9] = particle->radius;
+	sample[10] = particle->Tp;
+	sample[11] = particle->Tf;
+	sample[12] = particle->qinf;
+	sample[13] = particle->qstar;
+}
+
+extern "C" void ParticleTrack(GPU *gpu, const int count, const int *pidx, const int *procidx) {
+	free(gpu->hProbeKey);
+	free(gpu->hProbeOrder);
+	free(gpu->hProbePosition);
+
+	gpu->ProbeCount = MAX(count, 0);
+	gpu->hProbeKey = (long long *)malloc(sizeof(long long) * MAX(count, 1));
+	gpu->hProbeOrder = (int *)malloc(sizeof(int) * MAX(count, 1));
+	gpu->hProbePosition = (int *)malloc(sizeof(int) * MAX(count, 1));
+	for(int n = 0; n < gpu->ProbeCount; n++) {
+		gpu->hProbeKey[n] = ProbeKey(procidx[n], pidx[n]);
+		gpu->hProbeOrder[n] = n;
+	}
+	const long long *keys = gpu->hProbeKey;
+	std::sort(gpu->hProbeOrder, gpu->hProbeOrder + gpu->ProbeCount, [keys](const int a, const int b) { return keys[a] < keys[b]; });
+
+	// Samples of the previous probe set no longer line up
+	gpu->ProbeRecords = 0;
+	ProbeResolve(gpu);
+}
+
+extern "C" int ParticleProbe(GPU *gpu, Particle *output) {
+	int found = 0;
+	for(int n = 0; n < gpu->ProbeCount; n++) {
+		const int position = gpu->hProbePosition[n];
+		if(position < 0) {
+			memset(&output[n], 0, sizeof(Particle));
+			output[n].pidx = -1;
+			output[n].procidx = -1;
+			continue;
+		}
+		ParticleFetch(gpu, gpu->hSlot[position], &output[n]);
+		found++;
+	}
+	return found;
+}
+
+extern "C" void ParticleProbeSample(GPU *gpu, double *sample) {
+	for(int n = 0; n < gpu->ProbeCount; n++) {
+		const int position = gpu->hProbePosition[n];
+		if(position < 0) {
+			for(int f = 0; f < ProbeFields; f++) {
+				sample[n * ProbeFields + f] = NAN;
+			}
+			continue;
+		}
+
+		Particle particle;
+		ParticleFetch(gpu, gpu->hSlot[position], &particle);
+		ProbeSample(&particle, &sample[n * ProbeFields]);
+	}
+}
+
+// Appends the time followed by the sample of every probe to the series
+extern "C" void ParticleProbeRecord(GPU *gpu, const double time) {
+	const size_t record = 1 + (size_t)gpu->ProbeCount * ProbeFields;
+	if(gpu->ProbeRecords == gpu->ProbeCapacity) {
+		gpu->ProbeCapacity = MAX(2 * gpu->ProbeCapacity, 16);
+		gpu->hProbeSeries = (double *)realloc(gpu->hProbeSeries, sizeof(double) * record * gpu->ProbeCapacity);
+	}
+
+	double *target = &gpu->hProbeSeries[gpu->ProbeRecords * record];
+	target[0] = time;
+	ParticleProbeSample(gpu, &target[1]);
+	gpu->ProbeRecords++;
+}
+
+extern "C" int ParticleProbeRecords(GPU *gpu) {
+	return gpu->ProbeRecords;
+}
+
+// Copies every recorded sample to series in one block and empties the buffer
+extern "C" int ParticleProbeFlush(GPU *gpu, double *series) {
+	const int records = gpu->ProbeRecords;
+	memcpy(series, gpu->hProbeSeries, sizeof(double) * records * (1 + (size_t)gpu->ProbeCount * ProbeFields));
+	gpu->ProbeRecords = 0;
+	return records;
+}
+
+extern "C" void ParticleAdd(GPU *gpu, const int position, const Particle *input) {
+	gpu->StatisticsReady = 0;
+	assert(position >= 0 && position < gpu->pCount);
+	if(gpu->ProbeCount > 0) {
+		const int slot = gpu->hSlot[position];
+		ProbeMove(gpu, position, ProbeKey(gpu->hParticles.procidx[slot], gpu->hParticles.pidx[slot]), ProbeKey(input->procidx, input->pidx));
+	}
+	ParticleArraySet(&gpu->hParticles, gpu->hSlot[position], input);
+}
+
+extern "C" Particle ParticleGet(GPU *gpu, const int position) {
+	assert(position >= 0 && position < gpu->pCount);
+
+	Particle retVal;
+	ParticleArrayGet(&gpu->hParticles, gpu->hSlot[position], &retVal);
+	return retVal;
+}
+
+// Copies particles [first, first + count) from input in parallel. Each thread
+// scatters one contiguous block through hSlot, so the batch costs the same as
+// count calls of ParticleAdd spread over every host thread.
+extern "C" void ParticleAddBatch(GPU *gpu, const int first, const int count, const Particle *input) {
+	gpu->StatisticsReady = 0;
+	assert(first >= 0 && count >= 0 && first + count <= (int)gpu->pCount);
+
+	ParticleArray particles = gpu->hParticles;
+	const int *slots = &gpu->hSlot[first];
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		int index_start, index_end;
+		HostKernelRange(count, &index_start, &index_end);
+		for(int i = index_start; i < index_end; i++) {
+			ParticleArraySet(&particles, slots[i], &input[i]);
+		}
+	}
+
+	// Replacing particles may add or remove tracked ones anywhere in the batch
+	ProbeResolve(gpu);
+}
+
+// Copies particles [first, first + count) to output in parallel
+extern "C" void ParticleGetBatch(GPU *gpu, const int first, const int count, Particle *output) {
+	assert(first >= 0 && count >= 0 && first + count <= (int)gpu->pCount);
+
+	const ParticleArray particles = gpu->hParticles;
+	const int *slots = &gpu->hSlot[first];
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		int index_start, index_end;
+		HostKernelRange(count, &index_start, &index_end);
+		for(int i = index_start; i < index_end; i++) {
+			ParticleArrayGet(&particles, slots[i], &output[i]);
+		}
+	}
+}
+
+// Zero-copy view of one component of the host particle buffer. The array is
+// indexed by slot, not position; ParticleViewSlots maps positions to slots.
+extern "C" void *ParticleView(GPU *gpu, const int component) {
+	assert(component >= 0 && component < ParticleComponents);
+	return ParticleArrayComponent(&gpu->hParticles, component);
+}
+
+extern "C" int *ParticleViewSlots(GPU *gpu) {
+	return gpu->hSlot;
+}
+
+extern "C" void ParticleUpload(GPU *gpu) {
+	gpu->StatisticsReady = 0;
+	const TimerMark start = TimerStart();
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+		for(int c = 0; c < ParticleComponents; c++) {
+			const size_t size = ParticleComponentSize(c);
+			gpuErrchk(cudaMemcpyAsync(ParticleArrayComponent(&dev->Particles, c), (char *)ParticleArrayComponent(&gpu->hParticles, c) + dev->ParticleOffset * size, size * dev->ParticleCount, cudaMemcpyHostToDevice, dev->Stream));
+		}
+	}
+
+	TimerSynchronize(gpu);
+#endif
+	TimerStop(TIMER_UPLOAD, start, gpu->pCount, gpu->pCount * ParticleRecordBytes());
+}
+
+// Places every particle in the subdomain of the processor that owns it. Each
+// particle draws its position from the counter based generator keyed by its
+// pidx, so the result is independent of the number of threads.
+extern "C" void ParticleGenerate(GPU *gpu, const int processors, const int ncpus, const int seed, const double temperature, const double radius, const double qinfp) {
+	const int pcount = gpu->pCount;
+	const int particles_per_processor = pcount / processors;
+	const int particles_remaining = pcount % processors;
+	const double x_grid_change = gpu->FieldWidth / (double)ncpus, y_grid_change = gpu->FieldHeight / (double)ncpus;
+
+	memset(gpu->hParticles.Data, 0, ParticleComponents * gpu->hParticles.Stride);
+
+	const ParticleArray particles = gpu->hParticles;
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		int index_start, index_end;
+		HostKernelRange(pcount, &index_start, &index_end);
+		for(int offset = index_start; offset < index_end; offset++) {
+			int processor = 0, i = offset;
+			if(offset >= particles_per_processor + particles_remaining) {
+				processor = 1 + (offset - particles_per_processor - particles_remaining) / particles_per_processor;
+				i = (offset - particles_per_processor - particles_remaining) % particles_per_processor;
+			}
+
+			const double xMin = (processor / ncpus) * x_grid_change;
+			const double yMin = (processor % ncpus) * y_grid_change;
+
+			const int pidx = processor * pcount + (i + 1);
+			particles.pidx[offset] = pidx;
+			particles.xp[0][offset] = GPURandomUniform(seed, pidx, 0, 0) * x_grid_change + xMin;
+			particles.xp[1][offset] = GPURandomUniform(seed, pidx, 0, 1) * y_grid_change + yMin;
+			particles.xp[2][offset] = GPURandomUniform(seed, pidx, 0, 2) * (gpu->FieldDepth - 2.0 * radius) + radius;
+			particles.Tp[offset] = temperature;
+			particles.radius[offset] = radius;
+			particles.qinf[offset] = qinfp;
+
+			gpu->hSlot[offset] = offset;
+			gpu->hPosition[offset] = offset;
+		}
+	}
+
+	ProbeResolve(gpu);
+	ParticleUpload(gpu);
+}
+
+// Serial generator matching the Fortran particle_init, which reseeds ran2 for
+// every processor region. Used to verify GPU runs against the CPU code.
+
+extern "C" void ParticleGenerateLegacy(GPU *gpu, const int processors, const int ncpus, const int seed, const double temperature, const double radius, const double qinfp) {
+	const int particles_per_processor = gpu->pCount / processors;
+	const int particles_remaining = gpu->pCount % processors;
+	const double x_grid_change = gpu->FieldWidth / (double)ncpus, y_grid_change = gpu->FieldHeight / (double)ncpus;
+
+	double xMin = 0.0, xMax = x_grid_change;
+	double yMin = 0.0, yMax = y_grid_change;
+
+	memset(gpu->hParticles.Data, 0, ParticleComponents * gpu->hParticles.Stride);
+	for(int i = 0; i < (int)gpu->pCount; i++) {
+		gpu->hSlot[i] = i;
+		gpu->hPosition[i] = i;
+	}
+
+	int offset = 0;
+	for(size_t processor = 0; processor < processors; processor++) {
+		int particles = particles_per_processor;
+		if(processor == 0) particles += particles_remaining;
+
+		if(processor != 0 && processor % ncpus == 0) {
+			xMin += x_grid_change;
+			xMax += x_grid_change;
+
+			yMin = 0.0;
+			yMax = y_grid_change;
+		}
+
+		rand2_seed(seed);
+
+		for(size_t i = 0; i < particles; i++) {
+			gpu->hParticles.pidx[offset] = processor * gpu->pCount + (i + 1);
+			gpu->hParticles.xp[0][offset] = rand2() * (xMax - xMin) + xMin;
+			gpu->hParticles.xp[1][offset] = rand2() * (yMax - yMin) + yMin;
+			gpu->hParticles.xp[2][offset] = rand2() * (gpu->FieldDepth - 2.0 * radius) + radius;
+			gpu->hParticles.Tp[offset] = temperature;
+			gpu->hParticles.radius[offset] = radius;
+			gpu->hParticles.qinf[offset] = qinfp;
+
+			offset++;
+		}
+
+		yMin += y_grid_change;
+		yMax += y_grid_change;
+	}
+
+	ProbeResolve(gpu);
+	ParticleUpload(gpu);
+}
+
+// Stable parallel LSD radix sort of keys, carrying the original slot of each
+// key. Every thread histograms one contiguous block per pass and scatters it
+// to offsets ordered by (digit, thread), which keeps equal keys in order.
+void SortParticleKeys(const int count, const int threads, const unsigned int maxKey, unsigned int *keys, int *order, unsigned int *keyScratch, int *orderScratch) {
+	const int radixBits = 11, radix = 1 << radixBits;
+
+	int bits = 1;
+	while(bits < 32 && (maxKey >> bits) != 0) {
+		bits++;
+	}
+
+	int *histogram = (int *)malloc(sizeof(int) * radix * threads);
+	for(int shift = 0; shift < bits; shift += radixBits) {
+		memset(histogram, 0, sizeof(int) * radix * threads);
+
+#pragma omp parallel num_threads(threads)
+		{
+			int index_start, index_end;
+			HostKernelRange(count, &index_start, &index_end);
+#ifdef _OPENMP
+			int *local = &histogram[omp_get_thread_num() * radix];
+#else
+			int *local = histogram;
+#endif
+			for(int i = index_start; i < index_end; i++) {
+				local[(keys[i] >> shift) & (radix - 1)]++;
+			}
+
+#pragma omp barrier
+#pragma omp single
+			{
+				int sum = 0;
+				for(int digit = 0; digit < radix; digit++) {
+					for(int t = 0; t < threads; t++) {
+						const int value = histogram[t * radix + digit];
+						histogram[t * radix + digit] = sum;
+						sum += value;
+					}
+				}
+			}
+
+			for(int i = index_start; i < index_end; i++) {
+				const int target = local[(keys[i] >> shift) & (radix - 1)]++;
+				keyScratch[target] = keys[i];
+				orderScratch[target] = order[i];
+			}
+		}
+
+		memcpy(keys, keyScratch, sizeof(unsigned int) * count);
+		memcpy(order, orderScratch, sizeof(int) * count);
+	}
+	free(histogram);
+}
+
+extern "C" void ParticleSort(GPU *gpu, const double dx, const double dy) {
+	const TimerMark start = TimerStart();
+
+	const int pcount = gpu->pCount;
+	if(pcount < 2) return;
+
+#ifdef BUILD_CUDA
+	ParticleDownload(gpu);
+	const int threads = 1;
+#else
+	const int threads = HostThreads(gpu);
+#endif
+
+	unsigned int *keys = (unsigned int *)malloc(sizeof(unsigned int) * pcount * 2);
+	int *order = (int *)malloc(sizeof(int) * pcount * 2);
+
+	// Key each particle by the field cell holding it, in field memory order
+	const int nx = MAX(gpu->GridWidth, 1), ny = MAX(gpu->GridHeight, 1), nz = MAX(gpu->GridDepth, 1);
+	const unsigned int maxKey = (unsigned int)nx * ny * nz - 1;
+	const ParticleArray particles = gpu->hParticles;
+#pragma omp parallel num_threads(threads)
+	{
+		int index_start, index_end;
+		HostKernelRange(pcount, &index_start, &index_end);
+		for(int idx = index_start; idx < index_end; idx++) {
+			const int ix = MIN(MAX((int)floor(particles.xp[0][idx] / dx) + 2, 0), nx - 1);
+			const int iy = MIN(MAX((int)floor(particles.xp[1][idx] / dy) + 2, 0), ny - 1);
+			const int iz = MIN(MAX(GPULevelLocate(gpu->hZZLocator, gpu->hZZ, gpu->GridDepth, particles.xp[2][idx]), 0), nz - 1);
+			keys[idx] = ((unsigned int)iz * ny + iy) * nx + ix;
+			order[idx] = idx;
+		}
+	}
+
+	SortParticleKeys(pcount, threads, maxKey, keys, order, &keys[pcount], &order[pcount]);
+
+	// Gather every component into sorted order through one staging component
+	char *staging = (char *)malloc(gpu->hParticles.Stride);
+	for(int c = 0; c < ParticleComponents; c++) {
+		char *component = (char *)ParticleArrayComponent(&gpu->hParticles, c);
+		if(ParticleComponentSize(c) == sizeof(int)) {
+			const int *source = (const int *)component;
+			int *target = (int *)staging;
+#pragma omp parallel for num_threads(threads)
+			for(int i = 0; i < pcount; i++) {
+				target[i] = source[order[i]];
+			}
+		} else {
+			const double *source = (const double *)component;
+			double *target = (double *)staging;
+#pragma omp parallel for num_threads(threads)
+			for(int i = 0; i < pcount; i++) {
+				target[i] = source[order[i]];
+			}
+		}
+		memcpy(component, staging, ParticleComponentSize(c) * pcount);
+	}
+	free(staging);
+
+	// Carry the position mapping through the permutation
+	int *position = &order[pcount];
+#pragma omp parallel for num_threads(threads)
+	for(int i = 0; i < pcount; i++) {
+		position[i] = gpu->hPosition[order[i]];
+	}
+#pragma omp parallel for num_threads(threads)
+	for(int i = 0; i < pcount; i++) {
+		gpu->hPosition[i] = position[i];
+		gpu->hSlot[position[i]] = i;
+	}
+
+	free(keys);
+	free(order);
+
+#ifdef BUILD_CUDA
+	ParticleUpload(gpu);
+#endif
+
+	TimerStop(TIMER_SORT, start, pcount, pcount * 2.0 * ParticleRecordBytes());
+}
+
+// Host instruction sets available on this processor
+int ParticleSIMDSupport() {
+#if defined(BUILD_SIMD) && !defined(BUILD_CUDA)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if(__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+#endif
+	return SIMD_SCALAR;
+}
+
+#ifndef BUILD_CUDA
+int HostSIMDLevel(const GPU *gpu) {
+	const int support = ParticleSIMDSupport();
+	if(gpu->SIMDLevel < 0) return support;
+	return MIN(gpu->SIMDLevel, support);
+}
+
+// Updates particles [start, end) with the selected host instruction set
+void HostUpdateParticles(const int simd, const StepConstants *constants, const int it, const int istage, const int start, const int end, ParticleArray particles) {
+#ifdef BUILD_SIMD
+	if(simd == SIMD_AVX512) {
+		UpdateParticlesAVX512(constants, it, istage, start, end, particles);
+		return;
+	}
+	if(simd == SIMD_AVX2) {
+		UpdateParticlesAVX2(constants, it, istage, start, end, particles);
+		return;
+	}
+#endif
+	for(int idx = start; idx < end; idx++) {
+		GPUUpdateParticle(*constants, it, istage, idx, particles);
+	}
+}
+
+// Lagrange weights of count <= InterpolationBatch particles laid out as
+// [axis * 6 + node][lane] with the selected host instruction set
+void HostLagrangeWeights(const int simd, const int count, const double *offset, const double *inverse, double *weights) {
+#ifdef BUILD_SIMD
+	if(simd == SIMD_AVX512) {
+		LagrangeWeightsAVX512(count, offset, inverse, weights);
+		return;
+	}
+	if(simd == SIMD_AVX2) {
+		LagrangeWeightsAVX2(count, offset, inverse, weights);
+		return;
+	}
+#endif
+	for(int lane = 0; lane < count; lane++) {
+		double o[6], in[6], w[6];
+		for(int axis = 0; axis < 4; axis++) {
+			for(int k = 0; k < 6; k++) {
+				o[k] = offset[(axis * 6 + k) * InterpolationBatch + lane];
+				in[k] = inverse[(axis * 6 + k) * InterpolationBatch + lane];
+			}
+			GPULagrangeWeights(o, in, w);
+			for(int k = 0; k < 6; k++) {
+				weights[(axis * 6 + k) * InterpolationBatch + lane] = w[k];
+			}
+		}
+	}
+}
+
+// Sixth order interpolation of particles [start, end). Stencils are built a
+// batch at a time so that the weights of the whole batch are evaluated
+// together in vector registers.
+template <class View>
+void HostFieldInterpolate(const int simd, const GPU *gpu, const View field, const double dx, const double dy, const int start, const int end) {
+	const ParticleArray particles = gpu->hParticles;
+
+	InterpolationStencil stencil[InterpolationBatch];
+	double offset[24 * InterpolationBatch], inverse[24 * InterpolationBatch], weights[24 * InterpolationBatch];
+	for(int idx = start; idx < end; idx += InterpolationBatch) {
+		const int count = MIN(end - idx, InterpolationBatch);
+
+		for(int lane = 0; lane < count; lane++) {
+			const int i = idx + lane;
+			const double xp[3] = {particles.xp[0][i], particles.xp[1][i], particles.xp[2][i]};
+			int levels[2] = {gpu->StencilCache ? particles.level[0][i] : -2, gpu->StencilCache ? particles.level[1][i] : -2};
+			GPUInterpolationStencil(dx, dy, gpu->GridDepth, gpu->hZ, gpu->hZZ, gpu->hZLocator, gpu->hZZLocator, gpu->hZStencils, gpu->hZZStencils, gpu->hZDenominators, gpu->hZZDenominators, xp, levels, &stencil[lane]);
+			particles.level[0][i] = levels[0];
+			particles.level[1][i] = levels[1];
+			for(int n = 0; n < 24; n++) {
+				offset[n * InterpolationBatch + lane] = stencil[lane].Offset[n / 6][n % 6];
+				inverse[n * InterpolationBatch + lane] = stencil[lane].Inverse[n / 6][n % 6];
+			}
+		}
+
+		HostLagrangeWeights(simd, count, offset, inverse, weights);
+
+		for(int lane = 0; lane < count; lane++) {
+			double wt[4][6];
+			for(int n = 0; n < 24; n++) {
+				wt[n / 6][n % 6] = weights[n * InterpolationBatch + lane];
+			}
+			GPUInterpolationGather(field, &stencil[lane], wt, idx + lane, particles);
+		}
+	}
+}
+
+// Linear interpolation of particles [start, end) with the level spacings
+// from GPULevelSpacing
+template <class View>
+void HostFieldInterpolateLinear(const GPU *gpu, const View field, const double dx, const double dy, const double *dzu, const double *dzw, const int start, const int end) {
+	for(int idx = start; idx < end; idx++) {
+		GPUInterpolateLinear(field, dx, dy, gpu->GridDepth, gpu->hZ, gpu->hZZ, dzu, dzw, gpu->hZLocator, gpu->hZZLocator, gpu->StencilCache, idx, gpu->hParticles);
+	}
+}
+
+template <class View>
+void HostFieldInterpolateRange(const int simd, const GPU *gpu, const View field, const double dx, const double dy, const double *dzu, const double *dzw, const int start, const int end) {
+	if(gpu->mParameters.LinearInterpolation == 1) {
+		HostFieldInterpolateLinear(gpu, field, dx, dy, dzu, dzw, start, end);
+	} else {
+		HostFieldInterpolate(simd, gpu, field, dx, dy, start, end);
+	}
+}
+
+// Interpolates particles [start, end) through the view of the current field
+// layout. dzu and dzw are only read by linear interpolation.
+void HostInterpolate(const int simd, const GPU *gpu, const double dx, const double dy, const double *dzu, const double *dzw, const int start, const int end) {
+	fieldSize *const fields[5] = {gpu->hUext, gpu->hVext, gpu->hWext, gpu->hText, gpu->hQext};
+	switch(gpu->FieldLayout) {
+	case FIELD_INTERLEAVED:
+		HostFieldInterpolateRange(simd, gpu, FieldViewMake<InterleavedFieldView>(gpu->GridWidth, gpu->GridHeight, fields), dx, dy, dzu, dzw, start, end);
+		break;
+	case FIELD_BRICKED:
+		HostFieldInterpolateRange(simd, gpu, FieldViewMake<BrickedFieldView>(gpu->GridWidth, gpu->GridHeight, fields), dx, dy, dzu, dzw, start, end);
+		break;
+	default:
+		HostFieldInterpolateRange(simd, gpu, FieldViewMake<PlanarFieldView>(gpu->GridWidth, gpu->GridHeight, fields), dx, dy, dzu, dzw, start, end);
+		break;
+	}
+}
+#else
+template <class View>
+void DeviceFieldInterpolate(const GPU *gpu, Device *dev, const View field, const double dx, const double dy) {
+	const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
+	if(gpu->mParameters.LinearInterpolation == 1) {
+		GPUFieldInterpolateLinear<View><<<blocks, CUDA_BLOCK_THREADS, ((gpu->GridDepth * 2) + 2) * sizeof(double), dev->Stream>>>(field, dx, dy, gpu->GridDepth, dev->Z, dev->ZZ, dev->ZLocator, dev->ZZLocator, gpu->StencilCache, dev->ParticleCount, dev->Particles);
+	} else {
+		GPUFieldInterpolate<View><<<blocks, CUDA_BLOCK_THREADS, gpu->GridDepth * 2 * sizeof(double), dev->Stream>>>(field, dx, dy, gpu->GridDepth, dev->Z, dev->ZZ, dev->ZLocator, dev->ZZLocator, dev->ZStencils, dev->ZZStencils, dev->ZDenominators, dev->ZZDenominators, gpu->StencilCache, dev->ParticleCount, dev->Particles);
+	}
+}
+
+// Interpolates every particle on one device through the view of the current
+// field layout
+void DeviceInterpolate(const GPU *gpu, Device *dev, const double dx, const double dy) {
+	fieldSize *const fields[5] = {dev->Uext, dev->Vext, dev->Wext, dev->Text, dev->Qext};
+	switch(gpu->FieldLayout) {
+	case FIELD_INTERLEAVED:
+		DeviceFieldInterpolate(gpu, dev, FieldViewMake<InterleavedFieldView>(gpu->GridWidth, gpu->GridHeight, fields), dx, dy);
+		break;
+	case FIELD_BRICKED:
+		DeviceFieldInterpolate(gpu, dev, FieldViewMake<BrickedFieldView>(gpu->GridWidth, gpu->GridHeight, fields), dx, dy);
+		break;
+	default:
+		DeviceFieldInterpolate(gpu, dev, FieldViewMake<PlanarFieldView>(gpu->GridWidth, gpu->GridHeight, fields), dx, dy);
+		break;
+	}
+}
+#endif
+
+extern "C" void ParticleInterpolate(GPU *gpu, const double dx, const double dy) {
+	gpu->StatisticsReady = 0;
+	if(gpu->SortInterval > 0 && ++gpu->SortCounter >= gpu->SortInterval) {
+		gpu->SortCounter = 0;
+		ParticleSort(gpu, dx, dy);
+	}
+
+	gpu->InterpolationDx = dx;
+	gpu->InterpolationDy = dy;
+
+	const TimerMark start = TimerStart();
+
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+
+		DeviceInterpolate(gpu, dev, dx, dy);
+		gpuErrchk(cudaPeekAtLastError());
+	}
+
+	TimerSynchronize(gpu);
+#else
+	const int simd = HostSIMDLevel(gpu);
+	std::vector<double> dzu(gpu->GridDepth + 1), dzw(gpu->GridDepth + 1);
+	if(gpu->mParameters.LinearInterpolation == 1) {
+		GPULevelSpacing(gpu->hZZ, gpu->GridDepth, dzu.data());
+		GPULevelSpacing(gpu->hZ, gpu->GridDepth, dzw.data());
+	}
+
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		int index_start, index_end;
+		HostKernelRange(gpu->pCount, &index_start, &index_end);
+		HostInterpolate(simd, gpu, dx, dy, dzu.data(), dzw.data(), index_start, index_end);
+	}
+#endif
+
+	TimerStop(TIMER_INTERPOLATE, start, gpu->pCount, gpu->pCount * InterpolateBytes);
+}
+
+extern "C" void ParticleStep(GPU *gpu, const int it, const int istage, const double dt) {
+	gpu->StatisticsReady = 0;
+	const TimerMark start = TimerStart();
+
+	const StepConstants constants = StepConstantsBuild(&gpu->mParameters, dt);
+
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+
+		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
+		GPUUpdateParticles<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(constants, it, istage - 1, dev->ParticleCount, dev->Particles);
+		gpuErrchk(cudaPeekAtLastError());
+	}
+
+	TimerSynchronize(gpu);
+#else
+	const int simd = HostSIMDLevel(gpu);
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		int index_start, index_end;
+		HostKernelRange(gpu->pCount, &index_start, &index_end);
+		HostUpdateParticles(simd, &constants, it, istage - 1, index_start, index_end, gpu->hParticles);
+	}
+#endif
+
+	TimerStop(TIMER_STEP, start, gpu->pCount, gpu->pCount * StepBytes);
+}
+
+extern "C" void ParticleUpdateNonPeriodic(GPU *gpu) {
+	gpu->StatisticsReady = 0;
+	const TimerMark start = TimerStart();
+
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+
+		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
+		GPUUpdateNonperiodic<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(gpu->FieldWidth, gpu->FieldHeight, gpu->FieldDepth, dev->ParticleCount, dev->Particles);
+		gpuErrchk(cudaPeekAtLastError());
+	}
+
+	TimerSynchronize(gpu);
+#else
+#pragma omp parallel num_threads(HostThreads(gpu))
+	GPUUpdateNonperiodic(gpu->FieldWidth, gpu->FieldHeight, gpu->FieldDepth, gpu->pCount, gpu->hParticles);
+#endif
+
+	TimerStop(TIMER_NONPERIODIC, start, gpu->pCount, gpu->pCount * NonPeriodicBytes);
+}
+
+extern "C" void ParticleUpdatePeriodic(GPU *gpu) {
+	gpu->StatisticsReady = 0;
+	const TimerMark start = TimerStart();
+
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+
+		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
+		GPUUpdatePeriodic<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(gpu->FieldWidth, gpu->FieldHeight, dev->ParticleCount, dev->Particles);
+		gpuErrchk(cudaPeekAtLastError());
+	}
+
+	TimerSynchronize(gpu);
+#else
+#pragma omp parallel num_threads(HostThreads(gpu))
+	GPUUpdatePeriodic(gpu->FieldWidth, gpu->FieldHeight, gpu->pCount, gpu->hParticles);
+#endif
+
+	TimerStop(TIMER_PERIODIC, start, gpu->pCount, gpu->pCount * PeriodicBytes);
+}
+
+extern "C" void ParticleAdvance(GPU *gpu, const int it, const int substeps, const double dt) {
+	const TimerMark start = TimerStart();
+
+	const StepConstants constants = StepConstantsBuild(&gpu->mParameters, dt / substeps);
+
+	// Statistics requested by ParticleRequestStatistics are deposited as each
+	// particle finishes its final stage
+	const int statistics = gpu->StatisticsRequested;
+	const int nnz = gpu->GridDepth, size = StatisticsSize(nnz);
+	gpu->StatisticsRequested = 0;
+	gpu->StatisticsReady = statistics;
+	StatisticsClear(nnz, gpu->hStatistics);
+
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+
+		const unsigned int blocks = std::ceil(gpu->pCount / (double)CUDA_BLOCK_THREADS);
+		if(statistics) {
+			gpuErrchk(cudaMemcpyAsync(dev->Statistics, gpu->hStatistics, sizeof(double) * size, cudaMemcpyHostToDevice, dev->Stream));
+		}
+		if(!gpu->StageInterpolation) {
+			GPUAdvanceParticles<<<blocks, CUDA_BLOCK_THREADS, statistics ? sizeof(double) * size : 0, dev->Stream>>>(constants, it, substeps, gpu->FieldWidth, gpu->FieldHeight, gpu->FieldDepth, nnz, dev->Z, dev->ZLocator, statistics ? dev->Statistics : nullptr, dev->ParticleCount, dev->Particles);
+			gpuErrchk(cudaPeekAtLastError());
+			continue;
+		}
+
+		// Interpolate before every stage after the first
+		const double dx = gpu->InterpolationDx, dy = gpu->InterpolationDy;
+		for(int step = 0; step < substeps; step++) {
+			for(int istage = 0; istage < 3; istage++) {
+				if(step > 0 || istage > 0) {
+					DeviceInterpolate(gpu, dev, dx, dy);
+				}
+				GPUUpdateParticles<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(constants, it, istage, dev->ParticleCount, dev->Particles);
+				GPUUpdateNonperiodic<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(gpu->FieldWidth, gpu->FieldHeight, gpu->FieldDepth, dev->ParticleCount, dev->Particles);
+				GPUUpdatePeriodic<<<blocks, CUDA_BLOCK_THREADS, 0, dev->Stream>>>(gpu->FieldWidth, gpu->FieldHeight, dev->ParticleCount, dev->Particles);
+			}
+		}
+		if(statistics) {
+			GPUCalculateStatistics<<<blocks, CUDA_BLOCK_THREADS, sizeof(double) * size, dev->Stream>>>(nnz, dev->Z, dev->ZLocator, dev->ParticleCount, dev->Particles, dev->Statistics);
+		}
+		gpuErrchk(cudaPeekAtLastError());
+	}
+
+	TimerSynchronize(gpu);
+#else
+	// Advance small blocks through every stage so the vector update and the
+	// boundary passes share the block while it is in L1
+	const int simd = HostSIMDLevel(gpu), block = 64;
+	const ParticleArray particles = gpu->hParticles;
+
+	// Stage interpolation reuses the block and, through the stencil cache,
+	// usually the levels found at the previous stage
+	const double dx = gpu->InterpolationDx, dy = gpu->InterpolationDy;
+	std::vector<double> dzu(gpu->GridDepth + 1), dzw(gpu->GridDepth + 1);
+	if(gpu->StageInterpolation && gpu->mParameters.LinearInterpolation == 1) {
+		GPULevelSpacing(gpu->hZZ, gpu->GridDepth, dzu.data());
+		GPULevelSpacing(gpu->hZ, gpu->GridDepth, dzw.data());
+	}
+
+	const int threads = HostThreads(gpu);
+	std::vector<double> slices(statistics ? (size_t)threads * size : 0);
+
+#pragma omp parallel num_threads(threads)
+	{
+		int index_start, index_end;
+		HostKernelRange(gpu->pCount, &index_start, &index_end);
+
+		double *slice = nullptr;
+		if(statistics) {
+#ifdef _OPENMP
+			slice = &slices[(size_t)omp_get_thread_num() * size];
+#else
+			slice = slices.data();
+#endif
+			StatisticsClear(nnz, slice);
+		}
+
+		for(int first = index_start; first < index_end; first += block) {
+			const int last = MIN(first + block, index_end);
+			for(int step = 0; step < substeps; step++) {
+				for(int istage = 0; istage < 3; istage++) {
+					if(gpu->StageInterpolation && (step > 0 || istage > 0)) {
+						HostInterpolate(simd, gpu, dx, dy, dzu.data(), dzw.data(), first, last);
+					}
+					HostUpdateParticles(simd, &constants, it, istage, first, last, particles);
+					for(int idx = first; idx < last; idx++) {
+						GPUUpdateParticleNonperiodic(gpu->FieldDepth, idx, particles);
+						GPUUpdateParticlePeriodic(gpu->FieldWidth, gpu->FieldHeight, idx, particles);
+					}
+				}
+			}
+			if(statistics) {
+				for(int idx = first; idx < last; idx++) {
+					GPUStatisticsAccumulate(nnz, gpu->hZ, gpu->hZLocator, idx, particles, slice);
+				}
+			}
+		}
+	}
+
+	// Slices are merged in thread order, as in ParticleCalculateStatistics
+	for(size_t t = 0; t < slices.size() / size; t++) {
+		StatisticsMerge(nnz, &slices[t * size], gpu->hStatistics);
+	}
+#endif
+
+	const double stages = substeps * 3.0;
+	const double bytes = stages * (StepBytes + NonPeriodicBytes + PeriodicBytes) + (gpu->StageInterpolation ? (stages - 1.0) * InterpolateBytes : 0.0) + (statistics ? StatisticsBytes : 0.0);
+	TimerStop(TIMER_ADVANCE, start, gpu->pCount, gpu->pCount * bytes);
+}
+
+extern "C" void ParticleCalculateStatistics(GPU *gpu, const double dx, const double dy) {
+	const TimerMark start = TimerStart();
+	// Statistics deposited by the last ParticleAdvance skip the particle pass
+	const int nnz = gpu->GridDepth, size = StatisticsSize(nnz);
+	const int ready = gpu->StatisticsReady;
+	gpu->StatisticsReady = 0;
+
+#ifdef BUILD_CUDA
+	std::vector<double> total(size), slice(size);
+	StatisticsClear(nnz, total.data());
+	for(size_t i = 0; i < gpudevices() && !ready; i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+
+		const unsigned int blocks = std::ceil(dev->ParticleCount / (double)CUDA_BLOCK_THREADS);
+		gpuErrchk(cudaMemcpyAsync(dev->Statistics, total.data(), sizeof(double) * size, cudaMemcpyHostToDevice, dev->Stream));
+		GPUCalculateStatistics<<<blocks, CUDA_BLOCK_THREADS, sizeof(double) * size, dev->Stream>>>(nnz, dev->Z, dev->ZLocator, dev->ParticleCount, dev->Particles, dev->Statistics);
+		gpuErrchk(cudaPeekAtLastError());
+	}
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+		gpuErrchk(cudaMemcpyAsync(slice.data(), dev->Statistics, sizeof(double) * size, cudaMemcpyDeviceToHost, dev->Stream));
+		gpuErrchk(cudaStreamSynchronize(dev->Stream));
+		StatisticsMerge(nnz, slice.data(), total.data());
+	}
+#else
+	std::vector<double> total(gpu->hStatistics, gpu->hStatistics + size);
+	if(!ready) {
+		// Slices are merged in thread order
+		const int threads = HostThreads(gpu);
+		std::vector<double> slices((size_t)threads * size);
+#pragma omp parallel num_threads(threads)
+		{
+#ifdef _OPENMP
+			double *slice = &slices[(size_t)omp_get_thread_num() * size];
+#else
+			double *slice = slices.data();
+#endif
+			StatisticsClear(nnz, slice);
+			GPUCalculateStatistics(nnz, gpu->hZ, gpu->hZLocator, gpu->pCount, gpu->hParticles, slice);
+		}
+		StatisticsClear(nnz, total.data());
+		for(int t = 0; t < threads; t++) {
+			StatisticsMerge(nnz, &slices[(size_t)t * size], total.data());
+		}
+	}
+#endif
+
+	for(int k = 0; k < nnz; k++) {
+		const double *bin = &total[k * StatisticsFields];
+		gpu->hPartCount[k] = bin[STAT_COUNT];
+		for(int j = 0; j < 3; j++) {
+			gpu->hVPSum[k * 3 + j] = bin[STAT_VP + j];
+			gpu->hVPSumSQ[k * 3 + j] = bin[STAT_VPSQ + j];
+		}
+		gpu->hRPSum[k] = bin[STAT_RADIUS];
+		gpu->hTPSum[k] = bin[STAT_TP];
+		gpu->hTFSum[k] = bin[STAT_TF];
+		gpu->hQFSum[k] = bin[STAT_QF];
+		gpu->hQSTARSum[k] = bin[STAT_QSTAR];
+	}
+
+	//part_stats = radmean, radmin, radmax, xp1,xp2,xp3,vp1,vp2,vp3,uf1,uf2,uf3,rad1,Tp1,Tf1,qinf,qstar
+	gpu->part_stats[0] = total[nnz * StatisticsFields + 0] / gpu->pCount;
+	gpu->part_stats[1] = total[nnz * StatisticsFields + 1];
+	gpu->part_stats[2] = total[nnz * StatisticsFields + 2];
+	ParticleSampleStatistics(gpu, 1, &gpu->part_stats[3]);
+
+	TimerStop(TIMER_STATISTICS, start, ready ? 0 : gpu->pCount, ready ? 0.0 : gpu->pCount * StatisticsBytes);
+}
+
+void ParticleSampleStatistics(GPU *gpu, const int position, double *sample) {
+	if(position >= (int)gpu->pCount) return;
+
+	Particle particle;
+	ParticleFetch(gpu, gpu->hSlot[position], &particle);
+	ProbeSample(&particle, sample);
+}
+
+extern "C" void ParticleDownload(GPU *gpu) {
+	const TimerMark start = TimerStart();
+#ifdef BUILD_CUDA
+	for(size_t i = 0; i < gpudevices(); i++) {
+		SetDeviceIndex(gpu, i);
+		Device *dev = GetDeviceMemory(gpu);
+		for(int c = 0; c < ParticleComponents; c++) {
+			const size_t size = ParticleComponentSize(c);
+			gpuErrchk(cudaMemcpy((char *)ParticleArrayComponent(&gpu->hParticles, c) + dev->ParticleOffset * size, ParticleArrayComponent(&dev->Particles, c), size * dev->ParticleCount, cudaMemcpyDeviceToHost));
+		}
+	}
+#endif
+	TimerStop(TIMER_DOWNLOAD, start, gpu->pCount, gpu->pCount * ParticleRecordBytes());
+}
+
+// Checkpoints. A checkpoint is a CheckpointHeader followed by z, zz, the
+// position to slot map and the raw host particle block, each written with a
+// single call. Restoring the block as is keeps the particle order, so a
+// restarted run continues bit for bit.
+const char CheckpointMagic[8] = {'L', 'E', 'S', 'P', 'A', 'R', 'T', '\0'};
+const int CheckpointVersion = 1;
+
+struct CheckpointHeader {
+	char Magic[8];
+	int Version, HeaderSize, ParticleSize, Components;
+	unsigned int Count;
+	int GridWidth, GridHeight, GridDepth;
+	double FieldWidth, FieldHeight, FieldDepth;
+	Parameters Params;
+
+	int FieldLayout, SortInterval, SortCounter, StencilCache, StageInterpolation;
+	double InterpolationDx, InterpolationDy;
+
+	// rand2 state
+	int RandomIdum, RandomIy, RandomIdum2, RandomIv[random_NTAB];
+
+	unsigned long long Stride;
+};
+
+int CheckpointWrite(FILE *file, const void *data, const size_t size) {
+	return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+int CheckpointRead(FILE *file, void *data, const size_t size) {
+	return size == 0 || fread(data, size, 1, file) == 1;
+}
+
+void CheckpointHeaderFill(const GPU *gpu, CheckpointHeader *header) {
+	memset(header, 0, sizeof(CheckpointHeader));
+	memcpy(header->Magic, CheckpointMagic, sizeof(CheckpointMagic));
+	header->Version = CheckpointVersion;
+	header->HeaderSize = sizeof(CheckpointHeader);
+	header->ParticleSize = sizeof(Particle);
+	header->Components = ParticleComponents;
+	header->Count = gpu->pCount;
+	header->GridWidth = gpu->GridWidth;
+	header->GridHeight = gpu->GridHeight;
+	header->GridDepth = gpu->GridDepth;
+	header->FieldWidth = gpu->FieldWidth;
+	header->FieldHeight = gpu->FieldHeight;
+	header->FieldDepth = gpu->FieldDepth;
+	header->Params = gpu->mParameters;
+	header->FieldLayout = gpu->FieldLayout;
+	header->SortInterval = gpu->SortInterval;
+	header->SortCounter = gpu->SortCounter;
+	header->StencilCache = gpu->StencilCache;
+	header->StageInterpolation = gpu->StageInterpolation;
+	header->InterpolationDx = gpu->InterpolationDx;
+	header->InterpolationDy = gpu->InterpolationDy;
+	header->RandomIdum = random_idum;
+	header->RandomIy = random_iy;
+	header->RandomIdum2 = random_idum2;
+	memcpy(header->RandomIv, random_iv, sizeof(random_iv));
+	header->Stride = gpu->hParticles.Stride;
+}
+
+// The sections of a checkpoint in file order
+const int CheckpointSections = 5;
+void CheckpointSectionsGet(const GPU *gpu, const CheckpointHeader *header, const void **data, size_t *size) {
+	data[0] = header;
+	size[0] = sizeof(CheckpointHeader);
+	data[1] = gpu->hZ;
+	size[1] = sizeof(double) * gpu->GridDepth;
+	data[2] = gpu->hZZ;
+	size[2] = sizeof(double) * gpu->GridDepth;
+	data[3] = gpu->hSlot;
+	size[3] = sizeof(int) * gpu->pCount;
+	data[4] = gpu->hParticles.Data;
+	size[4] = ParticleComponents * gpu->hParticles.Stride;
+}
+
+// Moves path.tmp over path once it is complete, so an interrupted save never
+// replaces the previous checkpoint
+int CheckpointCommit(const std::string &temporary, const std::string &path, const int written) {
+	if(!written || rename(temporary.c_str(), path.c_str()) != 0) {
+		fprintf(stderr, "ParticleCheckpoint: cannot write %s\n", path.c_str());
+		remove(temporary.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+// Writes the checkpoint before returning. Returns 0 on success.
+extern "C" int ParticleCheckpoint(GPU *gpu, const char *path) {
+	const TimerMark start = TimerStart();
+	ParticleDownload(gpu);
+
+	CheckpointHeader header;
+	CheckpointHeaderFill(gpu, &header);
+
+	const void *data[CheckpointSections];
+	size_t size[CheckpointSections];
+	CheckpointSectionsGet(gpu, &header, data, size);
+
+	const std::string temporary = std::string(path) + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if(file == nullptr) {
+		fprintf(stderr, "ParticleCheckpoint: cannot open %s\n", temporary.c_str());
+		return -1;
+	}
+
+	int written = 1;
+	size_t bytes = 0;
+	for(int n = 0; n < CheckpointSections; n++) {
+		written = written && CheckpointWrite(file, data[n], size[n]);
+		bytes += size[n];
+	}
+	written = fclose(file) == 0 && written;
+	const int status = CheckpointCommit(temporary, path, written);
+	TimerStop(TIMER_CHECKPOINT, start, gpu->pCount, bytes);
+	return status;
+}
+
+// Background Checkpoints. ParticleCheckpointAsync copies the checkpoint into
+// a snapshot buffer, which is the only cost on the calling thread, and a
+// writer thread streams it to disk in CheckpointChunk writes from page
+// aligned offsets while the particles move on. The snapshot buffer is kept
+// between checkpoints; a new checkpoint first waits for the previous one.
+const size_t CheckpointAlignment = 4096;
+const size_t CheckpointChunk = 8 << 20;
+
+struct CheckpointWriter {
+	std::thread Thread;
+	char *Buffer;
+	size_t Capacity, Size;
+	std::string Path;
+	int Active, Status;
+
+	// Seconds spent copying the snapshot, writing it and blocked waiting,
+	// also recorded by the kernel timers when Timed. The writer thread only
+	// measures Write; ParticleCheckpointWait records it after the join.
+	double Snapshot, Write, Blocked;
+	int Timed;
+};
+
+void CheckpointWriterRun(CheckpointWriter *writer) {
+	auto start = std::chrono::steady_clock::now();
+
+	const std::string temporary = writer->Path + ".tmp";
+	int written = 0;
+	const int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(file >= 0) {
+		written = 1;
+		for(size_t offset = 0; written && offset < writer->Size;) {
+			const ssize_t count = write(file, writer->Buffer + offset, MIN(CheckpointChunk, writer->Size - offset));
+			if(count < 0 && errno == EINTR) continue;
+			written = count > 0;
+			offset += written ? count : 0;
+		}
+		written = close(file) == 0 && written;
+	} else {
+		fprintf(stderr, "ParticleCheckpoint: cannot open %s\n", temporary.c_str());
+	}
+	writer->Status = CheckpointCommit(temporary, writer->Path, written);
+
+	writer->Write = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Copies size bytes with every host thread
+void ParallelCopy(const GPU *gpu, char *target, const char *source, const size_t size) {
+	const int blocks = (int)((size + CheckpointChunk - 1) / CheckpointChunk);
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		int block_start, block_end;
+		HostKernelRange(blocks, &block_start, &block_end);
+		for(int block = block_start; block < block_end; block++) {
+			const size_t offset = block * CheckpointChunk;
+			memcpy(target + offset, source + offset, MIN(CheckpointChunk, size - offset));
+		}
+	}
+}
+
+extern "C" int ParticleCheckpointAsync(GPU *gpu, const char *path) {
+	ParticleCheckpointWait(gpu);
+	if(gpu->Writer == nullptr) {
+		gpu->Writer = new CheckpointWriter();
+		gpu->Writer->Buffer = nullptr;
+		gpu->Writer->Capacity = 0;
+		gpu->Writer->Active = 0;
+	}
+	CheckpointWriter *writer = gpu->Writer;
+
+	auto start = std::chrono::steady_clock::now();
+	ParticleDownload(gpu);
+
+	CheckpointHeader header;
+	CheckpointHeaderFill(gpu, &header);
+
+	const void *data[CheckpointSections];
+	size_t size[CheckpointSections];
+	CheckpointSectionsGet(gpu, &header, data, size);
+
+	writer->Size = 0;
+	for(int n = 0; n < CheckpointSections; n++) {
+		writer->Size += size[n];
+	}
+	if(writer->Size > writer->Capacity) {
+		free(writer->Buffer);
+		writer->Capacity = (writer->Size + CheckpointAlignment - 1) / CheckpointAlignment * CheckpointAlignment;
+		if(posix_memalign((void **)&writer->Buffer, CheckpointAlignment, writer->Capacity) != 0) {
+			writer->Buffer = nullptr;
+			writer->Capacity = 0;
+			fprintf(stderr, "ParticleCheckpoint: cannot allocate a %zu byte snapshot\n", writer->Size);
+			return -1;
+		}
+	}
+
+	size_t offset = 0;
+	for(int n = 0; n < CheckpointSections; n++) {
+		ParallelCopy(gpu, writer->Buffer + offset, (const char *)data[n], size[n]);
+		offset += size[n];
+	}
+	writer->Snapshot = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	writer->Timed = ParticleTimersEnabled();
+	if(writer->Timed) TimerRecord(TIMER_CHECKPOINT_SNAPSHOT, writer->Snapshot, gpu->pCount, writer->Size);
+
+	writer->Path = path;
+	writer->Status = 0;
+	writer->Write = 0.0;
+	writer->Blocked = 0.0;
+	writer->Active = 1;
+	writer->Thread = std::thread(CheckpointWriterRun, writer);
+	return 0;
+}
+
+// Blocks until the background checkpoint is on disk. Returns its status, or 0
+// if there is none.
+extern "C" int ParticleCheckpointWait(GPU *gpu) {
+	CheckpointWriter *writer = gpu->Writer;
+	if(writer == nullptr || !writer->Active) return 0;
+
+	auto start = std::chrono::steady_clock::now();
+	writer->Thread.join();
+	writer->Active = 0;
+	writer->Blocked = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if(writer->Timed) {
+		TimerRecord(TIMER_CHECKPOINT_WRITE, writer->Write, 0, writer->Size);
+		TimerRecord(TIMER_CHECKPOINT_BLOCKED, writer->Blocked, 0, 0.0);
+	}
+	return writer->Status;
+}
+
+// Snapshot, write and blocked seconds of the last background checkpoint
+extern "C" void ParticleCheckpointTimes(GPU *gpu, double *snapshot, double *write, double *blocked) {
+	const CheckpointWriter *writer = gpu->Writer;
+	*snapshot = writer != nullptr ? writer->Snapshot : 0.0;
+	*write = writer != nullptr ? writer->Write : 0.0;
+	*blocked = writer != nullptr ? writer->Blocked : 0.0;
+}
+
+// Rebuilds the GPU saved by ParticleCheckpoint and uploads its particles.
+// Returns nullptr if path is missing, truncated or from another version.
+extern "C" GPU *ParticleRestore(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if(file == nullptr) {
+		fprintf(stderr, "ParticleRestore: cannot open %s\n", path);
+		return nullptr;
+	}
+
+	CheckpointHeader header;
+	if(!CheckpointRead(file, &header, sizeof(CheckpointHeader)) || memcmp(header.Magic, CheckpointMagic, sizeof(CheckpointMagic)) != 0 || header.Version != CheckpointVersion || header.HeaderSize != (int)sizeof(CheckpointHeader) || header.ParticleSize != (int)sizeof(Particle) || header.Components != ParticleComponents || header.Stride != ParticleArrayStride(header.Count)) {
+		fprintf(stderr, "ParticleRestore: %s is not a version %d checkpoint\n", path, CheckpointVersion);
+		fclose(file);
+		return nullptr;
+	}
+
+	std::vector<double> z(MAX(header.GridDepth, 1)), zz(MAX(header.GridDepth, 1));
+	if(!CheckpointRead(file, z.data(), sizeof(double) * header.GridDepth) || !CheckpointRead(file, zz.data(), sizeof(double) * header.GridDepth)) {
+		fprintf(stderr, "ParticleRestore: %s is truncated\n", path);
+		fclose(file);
+		return nullptr;
+	}
+
+	GPU *gpu = NewGPU(header.Count, header.GridWidth, header.GridHeight, header.GridDepth, header.FieldWidth, header.FieldHeight, header.FieldDepth, z.data(), zz.data(), &header.Params);
+	if(!CheckpointRead(file, gpu->hSlot, sizeof(int) * gpu->pCount) || !CheckpointRead(file, gpu->hParticles.Data, ParticleComponents * gpu->hParticles.Stride)) {
+		fprintf(stderr, "ParticleRestore: %s is truncated\n", path);
+		fclose(file);
+		free(gpu);
+		return nullptr;
+	}
+	fclose(file);
+
+	for(int position = 0; position < (int)gpu->pCount; position++) {
+		gpu->hPosition[gpu->hSlot[position]] = position;
+	}
+
+	ParticleSetFieldLayout(gpu, header.FieldLayout);
+	gpu->SortInterval = header.SortInterval;
+	gpu->SortCounter = header.SortCounter;
+	gpu->StencilCache = header.StencilCache;
+	gpu->StageInterpolation = header.StageInterpolation;
+	gpu->InterpolationDx = header.InterpolationDx;
+	gpu->InterpolationDy = header.InterpolationDy;
+
+	random_idum = header.RandomIdum;
+	random_iy = header.RandomIy;
+	random_idum2 = header.RandomIdum2;
+	memcpy(random_iv, header.RandomIv, sizeof(random_iv));
+
+	ParticleUpload(gpu);
+	return gpu;
+}
+
+// Tiled Checkpoints. Particles are grouped by the tile of the horizontal
+// decomposition that contains them, tile ix * TilesY + iy for ix in
+// [xEdges[ix], xEdges[ix + 1]) and iy likewise, which is the rank that owns
+// the tile when TilesY = ncpu_s. The file is a TileHeader, the edges, a
+// TileIndex per tile and the Particle records of each tile in turn, so a
+// reader fetches its own tile with three small reads and one large one.
+const char TileMagic[8] = {'L', 'E', 'S', 'T', 'I', 'L', 'E', '\0'};
+const int TileVersion = 1;
+
+struct TileHeader {
+	char Magic[8];
+	int Version, HeaderSize, ParticleSize;
+	unsigned int Count;
+	int TilesX, TilesY;
+};
+
+struct TileIndex {
+	unsigned long long Offset, Count;
+};
+
+// Tile of the cell [edges[i], edges[i + 1]) holding position; positions
+// outside the edges go to the first or last tile
+int TileLocate(const int tiles, const double *edges, const double position) {
+	return (int)(std::upper_bound(edges + 1, edges + tiles, position) - (edges + 1));
+}
+
+extern "C" int ParticleTilesWrite(const char *path, const int count, const Particle *particles, const int tilesX, const double *xEdges, const int tilesY, const double *yEdges, const int threads) {
+	const int tiles = tilesX * tilesY;
+	int active = 1;
+#ifdef _OPENMP
+	active = threads > 0 ? threads : omp_get_max_threads();
+#endif
+
+	// Stable counting sort by tile, one contiguous block per thread
+	std::vector<int> tile(MAX(count, 1)), order(MAX(count, 1));
+	std::vector<unsigned long long> histogram((size_t)tiles * active, 0);
+#pragma omp parallel num_threads(active)
+	{
+		int index_start, index_end;
+		HostKernelRange(count, &index_start, &index_end);
+#ifdef _OPENMP
+		unsigned long long *local = &histogram[(size_t)omp_get_thread_num() * tiles];
+#else
+		unsigned long long *local = histogram.data();
+#endif
+		for(int i = index_start; i < index_end; i++) {
+			tile[i] = TileLocate(tilesX, xEdges, particles[i].xp[0]) * tilesY + TileLocate(tilesY, yEdges, particles[i].xp[1]);
+			local[tile[i]]++;
+		}
+
+#pragma omp barrier
+#pragma omp single
+		{
+			unsigned long long sum = 0;
+			for(int n = 0; n < tiles; n++) {
+				for(int t = 0; t < active; t++) {
+					const unsigned long long value = histogram[(size_t)t * tiles + n];
+					histogram[(size_t)t * tiles + n] = sum;
+					sum += value;
+				}
+			}
+		}
+
+		for(int i = index_start; i < index_end; i++) {
+			order[local[tile[i]]++] = i;
+		}
+	}
+
+	TileHeader header;
+	memset(&header, 0, sizeof(TileHeader));
+	memcpy(header.Magic, TileMagic, sizeof(TileMagic));
+	header.Version = TileVersion;
+	header.HeaderSize = sizeof(TileHeader);
+	header.ParticleSize = sizeof(Particle);
+	header.Count = count;
+	header.TilesX = tilesX;
+	header.TilesY = tilesY;
+
+	// After the scatter the last thread's counter of each tile is its end
+	std::vector<TileIndex> index(tiles);
+	const unsigned long long data = sizeof(TileHeader) + sizeof(double) * (tilesX + tilesY + 2) + sizeof(TileIndex) * tiles;
+	unsigned long long begin = 0;
+	for(int n = 0; n < tiles; n++) {
+		const unsigned long long end = histogram[(size_t)(active - 1) * tiles + n];
+		index[n].Offset = data + sizeof(Particle) * begin;
+		index[n].Count = end - begin;
+		begin = end;
+	}
+
+	std::vector<Particle> sorted(MAX(count, 1));
+#pragma omp parallel num_threads(active)
+	{
+		int index_start, index_end;
+		HostKernelRange(count, &index_start, &index_end);
+		for(int i = index_start; i < index_end; i++) {
+			sorted[i] = particles[order[i]];
+		}
+	}
+
+	const std::string temporary = std::string(path) + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if(file == nullptr) {
+		fprintf(stderr, "ParticleTilesWrite: cannot open %s\n", temporary.c_str());
+		return -1;
+	}
+	int written = CheckpointWrite(file, &header, sizeof(TileHeader));
+	written = written && CheckpointWrite(file, xEdges, sizeof(double) * (tilesX + 1));
+	written = written && CheckpointWrite(file, yEdges, sizeof(double) * (tilesY + 1));
+	written = written && CheckpointWrite(file, index.data(), sizeof(TileIndex) * tiles);
+	written = written && CheckpointWrite(file, sorted.data(), sizeof(Particle) * count);
+	written = fclose(file) == 0 && written;
+	return CheckpointCommit(temporary, path, written);
+}
+
+extern "C" int ParticleTileCheckpoint(GPU *gpu, const char *path, const int tilesX, const double *xEdges, const int tilesY, const double *yEdges) {
+	const TimerMark start = TimerStart();
+	ParticleDownload(gpu);
+
+	std::vector<Particle> particles(MAX(gpu->pCount, 1));
+	ParticleGetBatch(gpu, 0, gpu->pCount, particles.data());
+	const int status = ParticleTilesWrite(path, gpu->pCount, particles.data(), tilesX, xEdges, tilesY, yEdges, HostThreads(gpu));
+	TimerStop(TIMER_TILE_CHECKPOINT, start, gpu->pCount, gpu->pCount * (double)sizeof(Particle));
+	return status;
+}
+
+int TileReadAt(const int file, void *data, const size_t size, const unsigned long long offset) {
+	for(size_t done = 0; done < size;) {
+		const ssize_t count = pread(file, (char *)data + done, size - done, offset + done);
+		if(count < 0 && errno == EINTR) continue;
+		if(count <= 0) return 0;
+		done += count;
+	}
+	return 1;
+}
+
+// Index entry of tile, read without touching the particles of other tiles
+int TileFind(const int file, const int tile, TileIndex *entry) {
+	TileHeader header;
+	if(!TileReadAt(file, &header, sizeof(TileHeader), 0) || memcmp(header.Magic, TileMagic, sizeof(TileMagic)) != 0 || header.Version != TileVersion || header.HeaderSize != (int)sizeof(TileHeader) || header.ParticleSize != (int)sizeof(Particle)) return 0;
+	if(tile < 0 || tile >= header.TilesX * header.TilesY) return 0;
+
+	const unsigned long long offset = sizeof(TileHeader) + sizeof(double) * (header.TilesX + header.TilesY + 2) + sizeof(TileIndex) * tile;
+	return TileReadAt(file, entry, sizeof(TileIndex), offset);
+}
+
+// Particles in tile, or -1 if path is not a tiled checkpoint
+extern "C" int ParticleTileCount(const char *path, const int tile) {
+	const int file = open(path, O_RDONLY);
+	if(file < 0) return -1;
+
+	TileIndex entry;
+	const int found = TileFind(file, tile, &entry);
+	close(file);
+	return found ? (int)entry.Count : -1;
+}
+
+// Reads the particles of tile into output, which holds at least
+// ParticleTileCount of them. Returns the number read or -1.
+extern "C" int ParticleTileRead(const char *path, const int tile, Particle *output) {
+	const int file = open(path, O_RDONLY);
+	if(file < 0) {
+		fprintf(stderr, "ParticleTileRead: cannot open %s\n", path);
+		return -1;
+	}
+
+	TileIndex entry;
+	int found = TileFind(file, tile, &entry);
+	found = found && TileReadAt(file, output, sizeof(Particle) * entry.Count, entry.Offset);
+	close(file);
+	if(!found) {
+		fprintf(stderr, "ParticleTileRead: cannot read tile %d of %s\n", tile, path);
+		return -1;
+	}
+	return (int)entry.Count;
+}
+
+// Compressed Snapshots. Particles are encoded in slot order, which the sort
+// keeps cell ordered, in independent chunks of SnapshotChunk particles. Each
+// component of a chunk is kept apart, predicted from the previous particle
+// (integer delta, XOR of the double bits), byte-shuffled into planes so the
+// slowly changing high bytes line up, and packed with SnapshotLZCompress.
+// The slot to position map is stored as one more integer component.
+const char SnapshotMagic[8] = {'L', 'E', 'S', 'S', 'N', 'A', 'P', '\0'};
+const int SnapshotVersion = 1;
+const int SnapshotChunk = 16384;
+
+struct SnapshotHeader {
+	char Magic[8];
+	int Version, HeaderSize, Mode, Chunks;
+	unsigned int Count, ChunkSize;
+	unsigned long long Size;
+};
+
+// Components stored by mode, followed by the slot to position map. Compact
+// snapshots drop uf, xrhs, Tf, qinf and qstar.
+int SnapshotComponents(const int mode, int *components) {
+	int count = 0;
+	for(int c = 0; c < 25; c++) {
+		const int derived = (c >= 8 && c <= 13) || c == 20 || c == 23 || c == 24;
+		if(mode == SNAPSHOT_LOSSLESS || !derived) components[count++] = c;
+	}
+	components[count++] = ParticleComponents;
+	return count;
+}
+
+size_t SnapshotComponentSize(const int component) {
+	return component == ParticleComponents ? sizeof(int) : ParticleComponentSize(component);
+}
+
+char *SnapshotComponentData(GPU *gpu, const int component) {
+	return component == ParticleComponents ? (char *)gpu->hPosition : (char *)ParticleArrayComponent(&gpu->hParticles, component);
+}
+
+// LZ77 with LZ4 style sequences. A token holds the literal length and the
+// match length minus four in its two nibbles; a nibble of 15 continues in
+// bytes that are summed until one is below 255. The literals follow, then a
+// two byte offset and the match extension. The last sequence is literals
+// only and the final bytes are never matched.
+size_t SnapshotLZBound(const size_t size) {
+	return size + size / 255 + 16;
+}
+
+unsigned int SnapshotLZRead32(const unsigned char *data) {
+	unsigned int value;
+	memcpy(&value, data, sizeof(unsigned int));
+	return value;
+}
+
+unsigned char *SnapshotLZLength(unsigned char *output, size_t length) {
+	for(; length >= 255; length -= 255) {
+		*output++ = 255;
+	}
+	*output++ = (unsigned char)length;
+	return output;
+}
+
+unsigned char *SnapshotLZSequence(unsigned char *output, const unsigned char *literals, const size_t count, const size_t match, const size_t offset) {
+	unsigned char *token = output++;
+	*token = (unsigned char)(MIN(count, (size_t)15) << 4);
+	if(count >= 15) output = SnapshotLZLength(output, count - 15);
+	memcpy(output, literals, count);
+	output += count;
+	if(match == 0) return output;
+
+	*output++ = (unsigned char)(offset & 255);
+	*output++ = (unsigned char)(offset >> 8);
+	*token |= (unsigned char)MIN(match - 4, (size_t)15);
+	if(match - 4 >= 15) output = SnapshotLZLength(output, match - 4 - 15);
+	return output;
+}
+
+size_t SnapshotLZCompress(const unsigned char *input, const size_t size, unsigned char *output) {
+	const int hashBits = 14;
+	int table[1 << hashBits];
+	for(int i = 0; i < (1 << hashBits); i++) {
+		table[i] = -1;
+	}
+
+	unsigned char *out = output;
+	size_t anchor = 0, i = 0;
+	while(size >= 12 && i + 12 <= size) {
+		const unsigned int sequence = SnapshotLZRead32(&input[i]);
+		const unsigned int hash = (sequence * 2654435761u) >> (32 - hashBits);
+		const int candidate = table[hash];
+		table[hash] = (int)i;
+
+		if(candidate < 0 || i - candidate > 65535 || SnapshotLZRead32(&input[candidate]) != sequence) {
+			i++;
+			continue;
+		}
+
+		size_t match = 4;
+		while(i + match + 5 < size && input[candidate + match] == input[i + match]) {
+			match++;
+		}
+		out = SnapshotLZSequence(out, &input[anchor], i - anchor, match, i - candidate);
+		i += match;
+		anchor = i;
+	}
+	out = SnapshotLZSequence(out, &input[anchor], size - anchor, 0, 0);
+	return out - output;
+}
+
+// Expands exactly size bytes. Returns 0 if the input is malformed.
+int SnapshotLZDecompress(const unsigned char *input, const size_t length, unsigned char *output, const size_t size) {
+	const unsigned char *in = input, *end = input + length;
+	size_t out = 0;
+	while(in < end) {
+		const unsigned char token = *in++;
+
+		size_t count = token >> 4;
+		if(count == 15) {
+			unsigned char extra = 255;
+			while(extra == 255 && in < end) {
+				extra = *in++;
+				count += extra;
+			}
+		}
+		if(count > (size_t)(end - in) || count > size - out) return 0;
+		memcpy(&output[out], in, count);
+		in += count;
+		out += count;
+		if(out == size && in == end) return 1;
+
+		if(end - in < 2) return 0;
+		const size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t match = (token & 15) + 4;
+		if((token & 15) == 15) {
+			unsigned char extra = 255;
+			while(extra == 255 && in < end) {
+				extra = *in++;
+				match += extra;
+			}
+		}
+		if(offset == 0 || offset > out || match > size - out) return 0;
+		for(size_t k = 0; k < match; k++, out++) {
+			output[out] = output[out - offset];
+		}
+	}
+	return out == size;
+}
+
+// Predicts count values of width bytes from their predecessor and shuffles
+// the residuals into width byte planes
+void SnapshotPredict(const char *values, const int count, const size_t width, unsigned char *planes) {
+	unsigned long long previous = 0;
+	for(int i = 0; i < count; i++) {
+		unsigned long long residual;
+		if(width == sizeof(int)) {
+			int value;
+			memcpy(&value, values + i * width, width);
+			residual = (unsigned int)(value - (int)previous);
+			previous = (unsigned int)value;
+		} else {
+			unsigned long long value;
+			memcpy(&value, values + i * width, width);
+			residual = value ^ previous;
+			previous = value;
+		}
+		for(size_t b = 0; b < width; b++) {
+			planes[b * count + i] = (unsigned char)(residual >> (8 * b));
+		}
+	}
+}
+
+void SnapshotReconstruct(const unsigned char *planes, const int count, const size_t width, char *values) {
+	unsigned long long previous = 0;
+	for(int i = 0; i < count; i++) {
+		unsigned long long residual = 0;
+		for(size_t b = 0; b < width; b++) {
+			residual |= (unsigned long long)planes[b * count + i] << (8 * b);
+		}
+		if(width == sizeof(int)) {
+			const int value = (int)((unsigned int)residual + (unsigned int)previous);
+			memcpy(values + i * width, &value, width);
+			previous = (unsigned int)value;
+		} else {
+			const unsigned long long value = residual ^ previous;
+			memcpy(values + i * width, &value, width);
+			previous = value;
+		}
+	}
+}
+
+size_t SnapshotChunkBound(const int mode) {
+	int components[ParticleComponents + 1];
+	const int stored = SnapshotComponents(mode, components);
+
+	size_t bound = 0;
+	for(int n = 0; n < stored; n++) {
+		bound += sizeof(unsigned int) + SnapshotLZBound(SnapshotChunk * SnapshotComponentSize(components[n]));
+	}
+	return bound;
+}
+
+int SnapshotChunks(const GPU *gpu) {
+	return (gpu->pCount + SnapshotChunk - 1) / SnapshotChunk;
+}
+
+extern "C" size_t ParticleSnapshotBound(GPU *gpu, const int mode) {
+	const int chunks = SnapshotChunks(gpu);
+	return sizeof(SnapshotHeader) + sizeof(unsigned long long) * (chunks + 1) + chunks * SnapshotChunkBound(mode);
+}
+
+// Encodes the host particles into output, which holds ParticleSnapshotBound
+// bytes, and returns the encoded size. Chunks are compressed in parallel
+// into fixed regions and then packed in order, so the result does not
+// depend on the number of threads.
+extern "C" size_t ParticleSnapshotEncode(GPU *gpu, const int mode, char *output) {
+	const TimerMark start = TimerStart();
+	ParticleDownload(gpu);
+
+	const int chunks = SnapshotChunks(gpu);
+	int components[ParticleComponents + 1];
+	const int stored = SnapshotComponents(mode, components);
+
+	std::vector<unsigned long long> sizes(chunks);
+	unsigned long long *offsets = (unsigned long long *)(output + sizeof(SnapshotHeader));
+	char *payload = (char *)&offsets[chunks + 1];
+	const size_t chunkBound = SnapshotChunkBound(mode);
+
+#pragma omp parallel num_threads(HostThreads(gpu))
+	{
+		std::vector<unsigned char> planes(SnapshotChunk * sizeof(double));
+		int chunk_start, chunk_end;
+		HostKernelRange(chunks, &chunk_start, &chunk_end);
+		for(int chunk = chunk_start; chunk < chunk_end; chunk++) {
+			const int first = chunk * SnapshotChunk, count = MIN(SnapshotChunk, (int)gpu->pCount - first);
+
+			unsigned char *target = (unsigned char *)payload + chunk * chunkBound, *out = target;
+			for(int n = 0; n < stored; n++) {
+				const size_t width = SnapshotComponentSize(components[n]);
+				SnapshotPredict(SnapshotComponentData(gpu, components[n]) + first * width, count, width, planes.data());
+
+				const unsigned int length = (unsigned int)SnapshotLZCompress(planes.data(), count * width, out + sizeof(unsigned int));
+				memcpy(out, &length, sizeof(unsigned int));
+				out += sizeof(unsigned int) + length;
+			}
+			sizes[chunk] = out - target;
+		}
+	}
+
+	offsets[0] = 0;
+	for(int chunk = 0; chunk < chunks; chunk++) {
+		offsets[chunk + 1] = offsets[chunk] + sizes[chunk];
+		memmove(payload + offsets[chunk], payload + chunk * chunkBound, sizes[chunk]);
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(SnapshotHeader));
+	memcpy(header.Magic, SnapshotMagic, sizeof(SnapshotMagic));
+	header.Version = SnapshotVersion;
+	header.HeaderSize = sizeof(SnapshotHeader);
+	header.Mode = mode;
+	header.Chunks = chunks;
+	header.Count = gpu->pCount;
+	header.ChunkSize = SnapshotChunk;
+	header.Size = (payload - output) + offsets[chunks];
+	memcpy(output, &header, sizeof(SnapshotHeader));
+	TimerStop(TIMER_SNAPSHOT_ENCODE, start, gpu->pCount, gpu->pCount * ParticleRecordBytes() + header.Size);
+	return header.Size;
+}
+
+// Replaces the particles of gpu, which must have the same count, with the
+// snapshot and uploads them. Fields dropped by compact snapshots are zero
+// except xrhs, which takes vp; the next interpolation and update restore
+// them. Returns 0 on success; a malformed snapshot leaves the particles
+// undefined.
+extern "C" int ParticleSnapshotDecode(GPU *gpu, const char *input, const size_t size) {
+	const TimerMark start = TimerStart();
+	SnapshotHeader header;
+	if(size < sizeof(SnapshotHeader)) return -1;
+	memcpy(&header, input, sizeof(SnapshotHeader));
+	if(memcmp(header.Magic, SnapshotMagic, sizeof(SnapshotMagic)) != 0 || header.Version != SnapshotVersion || header.HeaderSize != (int)sizeof(SnapshotHeader) || header.ChunkSize != (unsigned int)SnapshotChunk) return -1;
+	if((header.Mode != SNAPSHOT_LOSSLESS && header.Mode != SNAPSHOT_COMPACT) || header.Count != gpu->pCount || header.Chunks != SnapshotChunks(gpu) || header.Size > size) return -1;
+
+	const int chunks = header.Chunks;
+	int components[ParticleComponents + 1];
+	const int stored = SnapshotComponents(header.Mode, components);
+
+	const unsigned long long *offsets = (const unsigned long long *)(input + sizeof(SnapshotHeader));
+	const char *payload = (const char *)&offsets[chunks + 1];
+	const unsigned long long payloadSize = header.Size - (payload - input);
+	if((size_t)(payload - input) > header.Size || offsets[chunks] > payloadSize) return -1;
+
+	memset(gpu->hParticles.Data, 0, ParticleComponents * gpu->hParticles.Stride);
+
+	int failed = 0;
+#pragma omp parallel num_threads(HostThreads(gpu)) reduction(+ : failed)
+	{
+		std::vector<unsigned char> planes(SnapshotChunk * sizeof(double));
+		int chunk_start, chunk_end;
+		HostKernelRange(chunks, &chunk_start, &chunk_end);
+		for(int chunk = chunk_start; chunk < chunk_end && failed == 0; chunk++) {
+			const int first = chunk * SnapshotChunk, count = MIN(SnapshotChunk, (int)gpu->pCount - first);
+			if(offsets[chunk] > offsets[chunk + 1] || offsets[chunk + 1] > payloadSize) {
+				failed++;
+				break;
+			}
+
+			const unsigned char *in = (const unsigned char *)payload + offsets[chunk], *end = (const unsigned char *)payload + offsets[chunk + 1];
+			for(int n = 0; n < stored && failed == 0; n++) {
+				const size_t width = SnapshotComponentSize(components[n]);
+				unsigned int length;
+				if(end - in < (long)sizeof(unsigned int)) {
+					failed++;
+					break;
+				}
+				memcpy(&length, in, sizeof(unsigned int));
+				in += sizeof(unsigned int);
+				if(length > (size_t)(end - in) || !SnapshotLZDecompress(in, length, planes.data(), count * width)) {
+					failed++;
+					break;
+				}
+				in += length;
+				SnapshotReconstruct(planes.data(), count, width, SnapshotComponentData(gpu, components[n]) + first * width);
+			}
+
+			// Derived fields and the level caches
+			for(int idx = first; idx < first + count; idx++) {
+				if(header.Mode == SNAPSHOT_COMPACT) {
+					for(int j = 0; j < 3; j++) {
+						gpu->hParticles.xrhs[j][idx] = gpu->hParticles.vp[j][idx];
+					}
+				}
+				gpu->hParticles.level[0][idx] = -2;
+				gpu->hParticles.level[1][idx] = -2;
+			}
+		}
+	}
+	if(failed > 0) return -1;
+
+	for(int slot = 0; slot < (int)gpu->pCount; slot++) {
+		gpu->hSlot[gpu->hPosition[slot]] = slot;
+	}
+	gpu->StatisticsReady = 0;
+	ProbeResolve(gpu);
+	ParticleUpload(gpu);
+	TimerStop(TIMER_SNAPSHOT_DECODE, start, gpu->pCount, gpu->pCount * ParticleRecordBytes() + header.Size);
+	return 0;
+}
+
+extern "C" int ParticleSnapshotWrite(GPU *gpu, const char *path, const int mode) {
+	std::vector<char> buffer(ParticleSnapshotBound(gpu, mode));
+	const size_t size = ParticleSnapshotEncode(gpu, mode, buffer.data());
+
+	const std::string temporary = std::string(path) + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if(file == nullptr) {
+		fprintf(stderr, "ParticleSnapshotWrite: cannot open %s\n", temporary.c_str());
+		return -1;
+	}
+	int written = CheckpointWrite(file, buffer.data(), size);
+	written = fclose(file) == 0 && written;
+	return CheckpointCommit(temporary, path, written);
+}
+
+extern "C" int ParticleSnapshotRead(GPU *gpu, const char *path) {
+	std::ifstream file(path, std::ios::binary);
+	if(!file) {
+		fprintf(stderr, "ParticleSnapshotRead: cannot open %s\n", path);
+		return -1;
+	}
+	std::vector<char> buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if(ParticleSnapshotDecode(gpu, buffer.data(), buffer.size()) != 0) {
+		fprintf(stderr, "ParticleSnapshotRead: %s is not a valid snapshot\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+// Trajectories. A recorder samples a fixed subset of particles, every
+// stride-th pidx or an explicit list, and buffers one column per sample
+// variable (the ProbeFields of ProbeSample) in memory. Full blocks are
+// appended to the file with one write each and a footer indexes them on
+// close:
+//
+//   TrajectoryHeader
+//   block: TrajectoryBlockHeader, iterations[R], times[R], pidx[M],
+//          ProbeFields columns of R x M doubles
+//   TrajectoryBlock[blocks], TrajectoryFooter
+//
+// The selected particles are kept by position like probes, so a record
+// costs O(M) and only rescans the particles when ParticleAdd replaced one.
+const char TrajectoryMagic[8] = {'L', 'E', 'S', 'T', 'R', 'A', 'J', '\0'};
+const int TrajectoryVersion = 1;
+const size_t TrajectoryBlockBytes = 4 << 20;
+
+struct TrajectoryHeader {
+	char Magic[8];
+	int Version, HeaderSize, Variables, Interval;
+};
+
+struct TrajectoryBlockHeader {
+	int Records, Particles;
+};
+
+struct TrajectoryBlock {
+	unsigned long long Offset;
+	int FirstIteration, LastIteration, Records, Particles;
+};
+
+struct TrajectoryFooter {
+	unsigned long long IndexOffset;
+	int Blocks, Padding;
+	char Magic[8];
+};
+
+struct TrajectoryRecorder {
+	FILE *File;
+	int Interval, Stride;
+	std::vector<int> List;
+
+	// Selected pidx in increasing order and the position of each
+	std::vector<int> Pidx, Position;
+
+	int BlockRecords, Records;
+	std::vector<int> Iterations;
+	std::vector<double> Times, Columns;
+
+	std::vector<TrajectoryBlock> Index;
+	unsigned long long Offset;
+	int Failed;
+};
+
+int TrajectorySelected(const TrajectoryRecorder *recorder, const int pidx) {
+	if(recorder->Stride > 0) return pidx > 0 && (pidx - 1) % recorder->Stride == 0;
+	return std::binary_search(recorder->List.begin(), recorder->List.end(), pidx);
+}
+
+void TrajectoryResolve(GPU *gpu, TrajectoryRecorder *recorder) {
+	std::vector<std::pair<int, int>> selected;
+	for(int position = 0; position < (int)gpu->pCount; position++) {
+		const int pidx = gpu->hParticles.pidx[gpu->hSlot[position]];
+		if(TrajectorySelected(recorder, pidx)) selected.push_back(std::make_pair(pidx, position));
+	}
+	std::sort(selected.begin(), selected.end());
+
+	recorder->Pidx.resize(selected.size());
+	recorder->Position.resize(selected.size());
+	for(size_t n = 0; n < selected.size(); n++) {
+		recorder->Pidx[n] = selected[n].first;
+		recorder->Position[n] = selected[n].second;
+	}
+}
+
+int TrajectoryFlush(TrajectoryRecorder *recorder) {
+	if(recorder->Records == 0) return 1;
+
+	const int records = recorder->Records, particles = (int)recorder->Pidx.size();
+	TrajectoryBlock block;
+	block.Offset = recorder->Offset;
+	block.FirstIteration = recorder->Iterations[0];
+	block.LastIteration = recorder->Iterations[records - 1];
+	block.Records = records;
+	block.Particles = particles;
+
+	const TrajectoryBlockHeader header = {records, particles};
+	int written = CheckpointWrite(recorder->File, &header, sizeof(TrajectoryBlockHeader));
+	written = written && CheckpointWrite(recorder->File, recorder->Iterations.data(), sizeof(int) * records);
+	written = written && CheckpointWrite(recorder->File, recorder->Times.data(), sizeof(double) * records);
+	written = written && CheckpointWrite(recorder->File, recorder->Pidx.data(), sizeof(int) * particles);
+	for(int v = 0; v < ProbeFields; v++) {
+		const double *column = &recorder->Columns[(size_t)v * recorder->BlockRecords * particles];
+		written = written && CheckpointWrite(recorder->File, column, sizeof(double) * records * particles);
+	}
+
+	recorder->Offset += sizeof(TrajectoryBlockHeader) + (sizeof(int) + sizeof(double)) * records + sizeof(int) * particles + sizeof(double) * ProbeFields * records * particles;
+	recorder->Index.push_back(block);
+	recorder->Records = 0;
+	recorder->Failed = recorder->Failed || !written;
+	return written;
+}
+
+// Starts recording every interval iterations into path. A positive stride
+// selects every stride-th pidx, otherwise the count pidx of list. Returns 0
+// on success.
+extern "C" int ParticleTrajectoryOpen(GPU *gpu, const char *path, const int interval, const int stride, const int count, const int *list) {
+	ParticleTrajectoryClose(gpu);
+
+	FILE *file = fopen(path, "wb");
+	if(file == nullptr) {
+		fprintf(stderr, "ParticleTrajectoryOpen: cannot open %s\n", path);
+		return -1;
+	}
+
+	TrajectoryRecorder *recorder = new TrajectoryRecorder();
+	recorder->File = file;
+	recorder->Failed = 0;
+	recorder->Interval = MAX(interval, 1);
+	recorder->Stride = stride;
+	if(stride <= 0) {
+		recorder->List.assign(list, list + MAX(count, 0));
+		std::sort(recorder->List.begin(), recorder->List.end());
+	}
+	TrajectoryResolve(gpu, recorder);
+
+	const size_t record = sizeof(double) * ProbeFields * MAX(recorder->Pidx.size(), (size_t)1);
+	recorder->BlockRecords = (int)MAX(TrajectoryBlockBytes / record, (size_t)1);
+	recorder->Records = 0;
+	recorder->Iterations.resize(recorder->BlockRecords);
+	recorder->Times.resize(recorder->BlockRecords);
+	recorder->Columns.resize((size_t)ProbeFields * recorder->BlockRecords * recorder->Pidx.size());
+
+	TrajectoryHeader header;
+	memset(&header, 0, sizeof(TrajectoryHeader));
+	memcpy(header.Magic, TrajectoryMagic, sizeof(TrajectoryMagic));
+	header.Version = TrajectoryVersion;
+	header.HeaderSize = sizeof(TrajectoryHeader);
+	header.Variables = ProbeFields;
+	header.Interval = recorder->Interval;
+	CheckpointWrite(file, &header, sizeof(TrajectoryHeader));
+	recorder->Offset = sizeof(TrajectoryHeader);
+
+	gpu->Trajectory = recorder;
+	return 0;
+}
+
+// Records the selected particles if it is a multiple of the interval. Only
+// they are fetched; the host slots and pidx stay current because particles
+// are only replaced through the host.
+extern "C" void ParticleTrajectoryRecord(GPU *gpu, const int it, const double time) {
+	TrajectoryRecorder *recorder = gpu->Trajectory;
+	if(recorder == nullptr || it % recorder->Interval != 0) return;
+
+	const TimerMark start = TimerStart();
+
+	// Replaced particles invalidate the selection; its size may change too
+	const int particles = (int)recorder->Pidx.size();
+	for(int n = 0; n < particles; n++) {
+		if(gpu->hParticles.pidx[gpu->hSlot[recorder->Position[n]]] != recorder->Pidx[n]) {
+			TrajectoryFlush(recorder);
+			TrajectoryResolve(gpu, recorder);
+			recorder->Columns.resize((size_t)ProbeFields * recorder->BlockRecords * recorder->Pidx.size());
+			break;
+		}
+	}
+
+	const int record = recorder->Records, selected = (int)recorder->Pidx.size();
+	recorder->Iterations[record] = it;
+	recorder->Times[record] = time;
+	for(int n = 0; n < selected; n++) {
+		Particle particle;
+		ParticleFetch(gpu, gpu->hSlot[recorder->Position[n]], &particle);
+
+		double sample[ProbeFields];
+		ProbeSample(&particle, sample);
+		for(int v = 0; v < ProbeFields; v++) {
+			recorder->Columns[((size_t)v * recorder->BlockRecords + record) * selected + n] = sample[v];
+		}
+	}
+
+	recorder->Records++;
+	if(recorder->Records == recorder->BlockRecords) TrajectoryFlush(recorder);
+	TimerStop(TIMER_TRAJECTORY, start, selected, selected * sizeof(double) * (double)ProbeFields);
+}
+
+// Writes the buffered records and the index. Returns 0 on success.
+extern "C" int ParticleTrajectoryClose(GPU *gpu) {
+	TrajectoryRecorder *recorder = gpu->Trajectory;
+	if(recorder == nullptr) return 0;
+
+	int written = TrajectoryFlush(recorder) && !recorder->Failed;
+
+	TrajectoryFooter footer;
+	memset(&footer, 0, sizeof(TrajectoryFooter));
+	footer.IndexOffset = recorder->Offset;
+	footer.Blocks = (int)recorder->Index.size();
+	memcpy(footer.Magic, TrajectoryMagic, sizeof(TrajectoryMagic));
+	written = written && CheckpointWrite(recorder->File, recorder->Index.data(), sizeof(TrajectoryBlock) * recorder->Index.size());
+	written = written && CheckpointWrite(recorder->File, &footer, sizeof(TrajectoryFooter));
+	written = fclose(recorder->File) == 0 && written;
+
+	delete recorder;
+	gpu->Trajectory = nullptr;
+	if(!written) fprintf(stderr, "ParticleTrajectoryClose: cannot write trajectories\n");
+	return written ? 0 : -1;
+}
+
+// Number of blocks in a closed trajectory file, or -1
+extern "C" int ParticleTrajectoryBlocks(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if(file == nullptr) return -1;
+
+	TrajectoryFooter footer;
+	const int found = fseek(file, -(long)sizeof(TrajectoryFooter), SEEK_END) == 0 && CheckpointRead(file, &footer, sizeof(TrajectoryFooter)) && memcmp(footer.Magic, TrajectoryMagic, sizeof(TrajectoryMagic)) == 0;
+	fclose(file);
+	return found ? footer.Blocks : -1;
+}
+
+// Reads one block through the footer index. With null outputs only records
+// and particles are returned; otherwise iterations and times hold records
+// values, pidx particles and columns ProbeFields x records x particles.
+// Returns 0 on success.
+extern "C" int ParticleTrajectoryReadBlock(const char *path, const int block, int *records, int *particles, int *iterations, double *times, int *pidx, double *columns) {
+	FILE *file = fopen(path, "rb");
+	if(file == nullptr) return -1;
+
+	TrajectoryFooter footer;
+	TrajectoryBlock entry;
+	int found = fseek(file, -(long)sizeof(TrajectoryFooter), SEEK_END) == 0 && CheckpointRead(file, &footer, sizeof(TrajectoryFooter)) && memcmp(footer.Magic, TrajectoryMagic, sizeof(TrajectoryMagic)) == 0;
+	found = found && block >= 0 && block < footer.Blocks;
+	found = found && fseek(file, footer.IndexOffset + sizeof(TrajectoryBlock) * block, SEEK_SET) == 0 && CheckpointRead(file, &entry, sizeof(TrajectoryBlock));
+
+	TrajectoryBlockHeader header;
+	found = found && fseek(file, entry.Offset, SEEK_SET) == 0 && CheckpointRead(file, &header, sizeof(TrajectoryBlockHeader));
+	if(found) {
+		*records = header.Records;
+		*particles = header.Particles;
+	}
+	if(found && iterations != nullptr) {
+		found = CheckpointRead(file, iterations, sizeof(int) * header.Records);
+		found = found && CheckpointRead(file, times, sizeof(double) * header.Records);
+		found = found && CheckpointRead(file, pidx, sizeof(int) * header.Particles);
+		found = found && CheckpointRead(file, columns, sizeof(double) * ProbeFields * header.Records * header.Particles);
+	}
+	fclose(file);
+	return found ? 0 : -1;
+}
+
+// Telemetry. Every interval steps ParticleTelemetryRecord formats one JSON
+// line with the seconds spent in each phase since the previous line, taken
+// from the kernel timers (enabled by ParticleTelemetryOpen) and the regions,
+// into a single producer, single consumer ring of TelemetrySlots lines. A
+// writer thread drains the ring to the file. The calling thread never waits
+// on it: a line that finds the ring full is dropped and counted, and every
+// line reports the count so far.
+const int TelemetrySlots = 1024;
+const size_t TelemetryLine = 4096;
+const int TelemetryPoll = 20;
+
+// Phases reported from the kernel timers; boundaries sums the two boundary
+// kernels
+const int TelemetryPhases = 7;
+const char *TelemetryPhaseNames[TelemetryPhases] = {"field", "sort", "interpolate", "step", "boundaries", "advance", "statistics"};
+const int TelemetryPhaseTimers[TelemetryPhases][2] = {{TIMER_FIELD, -1}, {TIMER_SORT, -1}, {TIMER_INTERPOLATE, -1}, {TIMER_STEP, -1}, {TIMER_NONPERIODIC, TIMER_PERIODIC}, {TIMER_ADVANCE, -1}, {TIMER_STATISTICS, -1}};
+
+struct TelemetrySink {
+	FILE *File;
+	int Interval, Failed;
+	std::thread Thread;
+
+	// Lines written by ParticleTelemetryRecord and drained by the writer
+	std::vector<char> Ring;
+	std::atomic<unsigned long long> Head, Tail;
+	std::atomic<int> Closing;
+	long long Dropped;
+
+	// Clock, step and timer totals at the previous line
+	int LastIt;
+	double LastClock, LastTimers[TimerCount];
+	std::vector<double> LastRegions;
+};
+
+void TelemetryRun(TelemetrySink *sink) {
+	for(;;) {
+		const int closing = sink->Closing.load(std::memory_order_acquire);
+		const unsigned long long head = sink->Head.load(std::memory_order_acquire);
+		unsigned long long tail = sink->Tail.load(std::memory_order_relaxed);
+		if(tail == head) {
+			if(closing) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(TelemetryPoll));
+			continue;
+		}
+
+		for(; tail < head; tail++) {
+			if(fputs(&sink->Ring[(tail % TelemetrySlots) * TelemetryLine], sink->File) < 0) sink->Failed = 1;
+		}
+		sink->Tail.store(tail, std::memory_order_release);
+		if(fflush(sink->File) != 0) sink->Failed = 1;
+	}
+}
+
+// Appends lines to path, counting throughput from step it. Returns 0 on
+// success.
+extern "C" int ParticleTelemetryOpen(GPU *gpu, const char *path, const int interval, const int it) {
+	ParticleTelemetryClose(gpu);
+
+	FILE *file = fopen(path, "a");
+	if(file == nullptr) {
+		fprintf(stderr, "ParticleTelemetryOpen: cannot open %s\n", path);
+		return -1;
+	}
+	ParticleTimersEnable(1);
+
+	TelemetrySink *sink = new TelemetrySink();
+	sink->File = file;
+	sink->Interval = MAX(interval, 1);
+	sink->Failed = 0;
+	sink->Ring.resize(TelemetrySlots * TelemetryLine);
+	sink->Head.store(0);
+	sink->Tail.store(0);
+	sink->Closing.store(0);
+	sink->Dropped = 0;
+
+	sink->LastIt = it;
+	sink->LastClock = ParticleTimerClock();
+	for(int timer = 0; timer < TimerCount; timer++) {
+		sink->LastTimers[timer] = Timers[timer].Total;
+	}
+	for(size_t region = 0; region < Regions.size(); region++) {
+		sink->LastRegions.push_back(Regions[region].Total);
+	}
+
+	sink->Thread = std::thread(TelemetryRun, sink);
+	gpu->Telemetry = sink;
+	return 0;
+}
+
+extern "C" void ParticleTelemetryRecord(GPU *gpu, const int it, const double time) {
+	TelemetrySink *sink = gpu->Telemetry;
+	if(sink == nullptr || it % sink->Interval != 0) return;
+
+	const double clock = ParticleTimerClock(), wall = clock - sink->LastClock;
+	const int steps = it - sink->LastIt;
+	double timers[TimerCount];
+	for(int timer = 0; timer < TimerCount; timer++) {
+		timers[timer] = Timers[timer].Total - sink->LastTimers[timer];
+		sink->LastTimers[timer] = Timers[timer].Total;
+	}
+	sink->LastRegions.resize(Regions.size(), 0.0);
+	sink->LastIt = it;
+	sink->LastClock = clock;
+
+	const unsigned long long head = sink->Head.load(std::memory_order_relaxed);
+	if(head - sink->Tail.load(std::memory_order_acquire) >= (unsigned long long)TelemetrySlots) {
+		sink->Dropped++;
+		for(size_t region = 0; region < Regions.size(); region++) {
+			sink->LastRegions[region] = Regions[region].Total;
+		}
+		return;
+	}
+
+	char *line = &sink->Ring[(head % TelemetrySlots) * TelemetryLine];
+	const double rate = wall > 0.0 ? gpu->pCount * (double)steps / wall : 0.0;
+	int length = snprintf(line, TelemetryLine, "{\"step\":%d,\"time\":%.9e,\"wall\":%.6e,\"particles\":%u,\"particle_steps_per_s\":%.6e,\"dropped\":%lld,\"phases\":{", it, time, wall, gpu->pCount, rate, sink->Dropped);
+	for(int phase = 0; phase < TelemetryPhases; phase++) {
+		const int *sources = TelemetryPhaseTimers[phase];
+		const double seconds = timers[sources[0]] + (sources[1] >= 0 ? timers[sources[1]] : 0.0);
+		length += snprintf(line + length, TelemetryLine - length, "%s\"%s\":%.6e", phase ? "," : "", TelemetryPhaseNames[phase], seconds);
+	}
+	length += snprintf(line + length, TelemetryLine - length, "},\"regions\":{");
+
+	// Regions that no longer fit in the line are left out
+	int written = 0;
+	for(size_t region = 0; region < Regions.size(); region++) {
+		const double seconds = Regions[region].Total - sink->LastRegions[region];
+		sink->LastRegions[region] = Regions[region].Total;
+		if(length + RegionNames[region].size() + 32 >= TelemetryLine) continue;
+		length += snprintf(line + length, TelemetryLine - length, "%s\"%s\":%.6e", written++ ? "," : "", RegionNames[region].c_str(), seconds);
+	}
+	snprintf(line + length, TelemetryLine - length, "}}\n");
+	sink->Head.store(head + 1, std::memory_order_release);
+}
+
+// Drains the ring and closes the file. Returns 0 if every line was written.
+extern "C" int ParticleTelemetryClose(GPU *gpu) {
+	TelemetrySink *sink = gpu->Telemetry;
+	if(sink == nullptr) return 0;
+
+	sink->Closing.store(1, std::memory_order_release);
+	sink->Thread.join();
+	const int written = fclose(sink->File) == 0 && !sink->Failed;
+	if(sink->Dropped > 0) fprintf(stderr, "ParticleTelemetryClose: %lld lines dropped\n", sink->Dropped);
+
+	delete sink;
+	gpu->Telemetry = nullptr;
+	return written ? 0 : -1;
+}
+
 void ParticleWrite(GPU *gpu) {
 	static int call = 0;
 	static char buffer[80];
@@ -1127,7 +4385,8 @@ void ParticleWrite(GPU *gpu) {
 
 	fwrite(&gpu->pCount, sizeof(unsigned int), 1, write_ptr);
 	for(int i = 0; i < gpu->pCount; i++) {
-		fwrite(&gpu->hParticles[i], sizeof(Particle), 1, write_ptr);
+		Particle particle = ParticleGet(gpu, i);
+		fwrite(&particle, sizeof(Particle), 1, write_ptr);
 	}
 
 	fclose(write_ptr);
@@ -1141,10 +4400,13 @@ GPU *ParticleRead(const char *path) {
 
 	double z[1], zz[1];
 
-	Parameters params;
+	// The file holds no parameters, so the GPU gets zeroed ones
+	Parameters params = {};
 	GPU *retVal = NewGPU(particles, 0, 0, 0, 0.0, 0.0, 0.0, &z[0], &zz[0], &params);
 	for(int i = 0; i < retVal->pCount; i++) {
-		fread(&retVal->hParticles[i], sizeof(Particle), 1, data);
+		Particle particle;
+		fread(&particle, sizeof(Particle), 1, data);
+		ParticleArraySet(&retVal->hParticles, i, &particle);
 	}
 
 	fclose(data);
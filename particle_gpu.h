@@ -19,6 +19,42 @@ struct Particle {
 	friend std::ostream &operator<<(std::ostream &stream, const Particle &p);
 };
 
+// Structure of arrays particle storage. Every component of Particle lives in
+// its own aligned array inside a single allocation so that each kernel only
+// streams the fields that it touches.
+const int ParticleComponents = 27;
+
+struct ParticleArray {
+	int *pidx, *procidx;
+	double *vp[3], *xp[3], *uf[3], *xrhs[3], *vrhs[3];
+	double *Tp, *Tprhs_s, *Tprhs_L, *Tf, *radius, *radrhs, *qinf, *qstar;
+
+	// Vertical levels (zz, z) found by the last interpolation, checked first
+	// by the next one
+	int *level[2];
+
+	// Backing allocation and the distance in bytes between components
+	char *Data;
+	size_t Stride;
+};
+
+// Uniform lookup table into a stretched vertical grid. Each bin stores the
+// highest level at or below the start of the bin so a search only has to
+// step across the levels that fall inside a single bin.
+struct LevelLocator {
+	int Bins;
+	double Origin, Scale;
+	int *Index;
+};
+
+// Sixth order vertical stencil of a particle located above one level: the six
+// levels used, the range [First, Last) of those that carry weight and the
+// offset of their inverse Lagrange denominators.
+struct LevelStencil {
+	int kpts[6];
+	int First, Last, Window;
+};
+
 struct Parameters {
 	int Evaporation, LinearInterpolation;
 
@@ -34,37 +70,104 @@ struct Parameters {
 	double radius_mass;
 };
 
+// Parameter combinations used by the droplet update, hoisted out of the
+// per-particle loop. dtZ and dtG hold the RK3 coefficients for each stage.
+struct StepConstants {
+	double m_s, CpaCpp, Lv, pPra, pSc, g[3];
+	double nuf, rhow, rhoa, Pra, Sc, Evaporation;
+	double Volp, taup, EffC, EffCDenominator, EffS, estar, qstar, TprhsL;
+	double dtZ[3], dtG[3];
+};
+
 struct Device {
 #ifdef BUILD_CUDA
 	cudaStream_t Stream;
 #endif
 	int ParticleCount, ParticleOffset;
 
-	Particle *Particles;
+	ParticleArray Particles;
 	fieldSize *Uext, *Vext, *Wext, *Text, *Qext;
 	double *Z, *ZZ;
+	LevelLocator ZLocator, ZZLocator;
+	double *ZDenominators, *ZZDenominators;
+	LevelStencil *ZStencils, *ZZStencils;
+	double *Statistics;
 };
 
+// Background checkpoint writer, trajectory recorder and telemetry sink,
+// private to particle_gpu.cpp
+struct CheckpointWriter;
+struct TrajectoryRecorder;
+struct TelemetrySink;
+
 struct GPU {
 	Parameters mParameters;
 
 	unsigned int pCount;
-	Particle *hParticles, *dParticles;
+	ParticleArray hParticles;
 
 	int GridHeight, GridWidth, GridDepth;
 	double FieldWidth, FieldHeight, FieldDepth;
 
+	// Field Storage. The five fields share one block of 5 * FieldCapacity
+	// elements stored in FieldLayout (see ParticleSetFieldLayout).
 	fieldSize *hUext, *hVext, *hWext, *hText, *hQext;
+	int FieldLayout;
+	size_t FieldCapacity;
 	double *hZ, *hZZ;
+	LevelLocator hZLocator, hZZLocator;
+	double *hZDenominators, *hZZDenominators;
+	LevelStencil *hZStencils, *hZZStencils;
 
 	// Statistics
         double *hPartCount, *hVPSum, *hVPSumSQ, *hRPSum, *hTPSum, *hTFSum, *hQFSum, *hQSTARSum;
         //double radmean, radmin, radmax, xp1,xp2,xp3,vp1,vp2,vp3,uf1,uf2,uf3,rad1,Tp1,Tf1,qinf,qstar
         double part_stats[17];
 
+	// Statistics deposited by ParticleAdvance after ParticleRequestStatistics.
+	// StatisticsReady is cleared by every call that moves the particles.
+	int StatisticsRequested, StatisticsReady;
+	double *hStatistics;
+
 	// GPU Memory
 	Device *mDevices;
 	unsigned int cDevice, DeviceCount;
+
+	// Host threads used by the particle kernels (0 uses the OpenMP default)
+	int ThreadCount;
+
+	// Host vector instruction set for the update kernel (-1 selects the best
+	// supported, see ParticleSetSIMD)
+	int SIMDLevel;
+
+	// Particle Ordering. Particles are periodically reordered by grid cell;
+	// hSlot maps the position used by ParticleAdd/ParticleGet to the current
+	// array slot and hPosition is its inverse.
+	int SortInterval, SortCounter;
+	int *hSlot, *hPosition;
+
+	// Tracked Particles (see ParticleTrack)
+	int ProbeCount;
+	long long *hProbeKey;
+	int *hProbeOrder, *hProbePosition;
+	int ProbeRecords, ProbeCapacity;
+	double *hProbeSeries;
+
+	// Background Checkpoints (see ParticleCheckpointAsync)
+	CheckpointWriter *Writer;
+
+	// Trajectories (see ParticleTrajectoryOpen)
+	TrajectoryRecorder *Trajectory;
+
+	// Telemetry (see ParticleTelemetryOpen)
+	TelemetrySink *Telemetry;
+
+	// Interpolation. StencilCache reuses the levels found for each particle by
+	// the previous interpolation and StageInterpolation has ParticleAdvance
+	// interpolate again before every RK stage with the spacing of the last
+	// ParticleInterpolate.
+	int StencilCache, StageInterpolation;
+	double InterpolationDx, InterpolationDy;
 };
 
 extern "C" void rand2_seed(int seed);
@@ -75,15 +178,136 @@ extern "C" Particle ParticleGet(GPU *gpu, const int position);
 extern "C" void ParticleUpload(GPU *gpu);
 extern "C" void ParticleInit(GPU *gpu, const int particles, const Particle *input);
 extern "C" void ParticleGenerate(GPU *gpu, const int processors, const int ncpus, const int seed, const double temperature, const double radius, const double qinfp);
+extern "C" void ParticleGenerateLegacy(GPU *gpu, const int processors, const int ncpus, const int seed, const double temperature, const double radius, const double qinfp);
 extern "C" void ParticleInterpolate(GPU *gpu, const double dx, const double dy);
 extern "C" void ParticleStep(GPU *gpu, const int it, const int istage, const double dt);
 extern "C" void ParticleUpdateNonPeriodic(GPU *gpu);
 extern "C" void ParticleUpdatePeriodic(GPU *gpu);
+extern "C" void ParticleAdvance(GPU *gpu, const int it, const int substeps, const double dt);
 extern "C" void ParticleCalculateStatistics(GPU *gpu, const double dx, const double dy);
+extern "C" void ParticleRequestStatistics(GPU *gpu);
 extern "C" void ParticleDownload(GPU *gpu);
 extern "C" void ParticleUpdate(GPU *gpu, const int it, const int istage, const double dt, const double dx, const double dy);
+extern "C" void ParticleSetThreads(GPU *gpu, const int threads);
+extern "C" void ParticleSetSortInterval(GPU *gpu, const int interval);
+extern "C" void ParticleSetSIMD(GPU *gpu, const int level);
+extern "C" void ParticleSetStencilCache(GPU *gpu, const int enabled);
+extern "C" void ParticleSetStageInterpolation(GPU *gpu, const int enabled);
+extern "C" void ParticleSetFieldLayout(GPU *gpu, const int layout);
+extern "C" void ParticleSort(GPU *gpu, const double dx, const double dy);
 extern "C" void ParticleFieldSet(GPU *gpu, fieldSize *uext, fieldSize *vext, fieldSize *wext, fieldSize *text, fieldSize *qext);
 
+// Tracked Particles. ParticleTrack registers particles by (procidx, pidx);
+// a probe whose particle is absent reads back as pidx -1 or NaN samples.
+// Samples hold ProbeFields values per probe in the order of part_stats[3..16]
+// and a series record is the time followed by one sample per probe.
+const int ProbeFields = 14;
+extern "C" void ParticleTrack(GPU *gpu, const int count, const int *pidx, const int *procidx);
+extern "C" int ParticleProbe(GPU *gpu, Particle *output);
+extern "C" void ParticleProbeSample(GPU *gpu, double *sample);
+extern "C" void ParticleProbeRecord(GPU *gpu, const double time);
+extern "C" int ParticleProbeRecords(GPU *gpu);
+extern "C" int ParticleProbeFlush(GPU *gpu, double *series);
+
+// Bulk Access. Batches copy whole ranges of positions at once. A view is the
+// host array of one component in slot order (component numbers follow the
+// order of Particle: pidx 0, procidx 1, vp 2-4, xp 5-7, uf 8-10, xrhs 11-13,
+// vrhs 14-16, Tp 17, Tprhs_s 18, Tprhs_L 19, Tf 20, radius 21, radrhs 22,
+// qinf 23, qstar 24) holding pCount entries. It is current after
+// ParticleDownload and edits reach the devices with ParticleUpload.
+extern "C" void ParticleAddBatch(GPU *gpu, const int first, const int count, const Particle *input);
+extern "C" void ParticleGetBatch(GPU *gpu, const int first, const int count, Particle *output);
+extern "C" void *ParticleView(GPU *gpu, const int component);
+extern "C" int *ParticleViewSlots(GPU *gpu);
+
+// Checkpoints (see ParticleCheckpoint). ParticleCheckpoint returns 0 on
+// success and ParticleRestore nullptr on failure. ParticleCheckpointAsync
+// returns once the particles are copied and ParticleCheckpointWait, which
+// must be called before exit, reports whether the write succeeded.
+extern "C" int ParticleCheckpoint(GPU *gpu, const char *path);
+extern "C" int ParticleCheckpointAsync(GPU *gpu, const char *path);
+extern "C" int ParticleCheckpointWait(GPU *gpu);
+extern "C" void ParticleCheckpointTimes(GPU *gpu, double *snapshot, double *write, double *blocked);
+extern "C" GPU *ParticleRestore(const char *path);
+
+// Tiled Checkpoints (see ParticleTilesWrite). Each rank of the horizontal
+// decomposition reads only its own tile; tiles are numbered ix * tilesY + iy
+// and bounded by tilesX + 1 xEdges and tilesY + 1 yEdges. Writers return 0 on
+// success and readers -1 on failure.
+extern "C" int ParticleTilesWrite(const char *path, const int count, const Particle *particles, const int tilesX, const double *xEdges, const int tilesY, const double *yEdges, const int threads);
+extern "C" int ParticleTileCheckpoint(GPU *gpu, const char *path, const int tilesX, const double *xEdges, const int tilesY, const double *yEdges);
+extern "C" int ParticleTileCount(const char *path, const int tile);
+extern "C" int ParticleTileRead(const char *path, const int tile, Particle *output);
+
+// Compressed Snapshots (see ParticleSnapshotEncode). Lossless snapshots
+// restore every particle bit for bit; compact snapshots omit the fields that
+// the next interpolation and update recompute (uf, xrhs, Tf, qinf, qstar).
+enum { SNAPSHOT_LOSSLESS, SNAPSHOT_COMPACT };
+extern "C" size_t ParticleSnapshotBound(GPU *gpu, const int mode);
+extern "C" size_t ParticleSnapshotEncode(GPU *gpu, const int mode, char *output);
+extern "C" int ParticleSnapshotDecode(GPU *gpu, const char *input, const size_t size);
+extern "C" int ParticleSnapshotWrite(GPU *gpu, const char *path, const int mode);
+extern "C" int ParticleSnapshotRead(GPU *gpu, const char *path);
+
+// Trajectories (see ParticleTrajectoryOpen). Each record holds the
+// ProbeFields of ProbeSample for every selected particle. Columns of a block
+// are laid out [variable][record][particle] with particles in pidx order.
+extern "C" int ParticleTrajectoryOpen(GPU *gpu, const char *path, const int interval, const int stride, const int count, const int *list);
+extern "C" void ParticleTrajectoryRecord(GPU *gpu, const int it, const double time);
+extern "C" int ParticleTrajectoryClose(GPU *gpu);
+extern "C" int ParticleTrajectoryBlocks(const char *path);
+extern "C" int ParticleTrajectoryReadBlock(const char *path, const int block, int *records, int *particles, int *iterations, double *times, int *pidx, double *columns);
+
+// Kernel Timers (see ParticleTimersEnable). The registry is shared by every
+// GPU in the process. ParticleTimersGet fills TimerValues entries: calls,
+// total, min and max seconds, particles, bytes and then TimerBuckets counts
+// of calls taking under 1 us (bucket 0) or [2^(b-1), 2^b) us (bucket b).
+// ParticleTimersWrite prints to stdout when path is empty.
+enum { TIMER_SORT, TIMER_INTERPOLATE, TIMER_STEP, TIMER_NONPERIODIC, TIMER_PERIODIC, TIMER_ADVANCE, TIMER_STATISTICS, TIMER_FIELD, TIMER_UPLOAD, TIMER_DOWNLOAD, TIMER_CHECKPOINT, TIMER_CHECKPOINT_SNAPSHOT, TIMER_CHECKPOINT_WRITE, TIMER_CHECKPOINT_BLOCKED, TIMER_TILE_CHECKPOINT, TIMER_SNAPSHOT_ENCODE, TIMER_SNAPSHOT_DECODE, TIMER_TRAJECTORY, TimerCount };
+enum { TIMERS_TABLE, TIMERS_JSON, TIMERS_CSV };
+const int TimerBuckets = 32;
+const int TimerValues = 6 + TimerBuckets;
+extern "C" void ParticleTimersEnable(const int enabled);
+extern "C" int ParticleTimersEnabled();
+extern "C" void ParticleTimersReset();
+extern "C" const char *ParticleTimerName(const int timer);
+extern "C" int ParticleTimersGet(const int timer, double *values);
+extern "C" int ParticleTimersWrite(const char *path, const int format);
+
+// Hardware Counters (see ParticleCountersEnable). Counted around the same
+// entry points as the kernel timers and written with them. ParticleCountersGet
+// fills CounterCount totals for a timer, -1 for counters that are unavailable.
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_LLC_MISSES, COUNTER_DTLB_MISSES, COUNTER_BRANCH_MISSES, CounterCount };
+extern "C" int ParticleCountersEnable(const GPU *gpu, const int enabled);
+extern "C" const char *ParticleCounterName(const int counter);
+extern "C" int ParticleCountersGet(const int timer, double *values);
+
+// Regions (see ParticleRegion). Per rank timers of the calling code, written
+// once reduced over ranks in the formats of ParticleTimersWrite.
+extern "C" double ParticleTimerClock();
+extern "C" int ParticleRegion(const char *name);
+extern "C" void ParticleRegionRecord(const int region, const double seconds);
+extern "C" int ParticleRegionCount();
+extern "C" int ParticleRegionNames(char *names, const int size);
+extern "C" void ParticleRegionsMerge(const char *names, const int size);
+extern "C" void ParticleRegionsGet(const int count, double *calls, double *totals);
+extern "C" int ParticleRegionsWrite(const char *path, const int format, const int ranks, const int count, const double *calls, const double *minimum, const double *mean, const double *maximum);
+
+// Trace (see ParticleTraceEnable). Begin and end of every kernel and region
+// of the sampled steps, written by the ranks as Chrome trace_event JSON.
+extern "C" void ParticleTraceEnable(const int rank, const int capacity, const int sampling);
+extern "C" void ParticleTraceStep(const int it);
+extern "C" long long ParticleTraceDropped();
+extern "C" int ParticleTraceEvents(char *events, const int size);
+extern "C" int ParticleTraceWrite(const char *path, const char *events, const long long size);
+
+// Telemetry (see ParticleTelemetryOpen). One JSON line per record with the
+// step, time, wall seconds, particles, particle steps per second, lines
+// dropped so far and the seconds of each phase and region since the last.
+extern "C" int ParticleTelemetryOpen(GPU *gpu, const char *path, const int interval, const int it);
+extern "C" void ParticleTelemetryRecord(GPU *gpu, const int it, const double time);
+extern "C" int ParticleTelemetryClose(GPU *gpu);
+
 extern "C" void ParticleWrite(GPU *gpu);
 extern "C" GPU *ParticleRead(const char *path);
 
@@ -92,6 +316,49 @@ extern "C" void PrintFreeMemory();
 // Fortran Data Access
 extern "C" void ParticleFillStatistics(GPU *gpu, double *partCount, double *vSum, double *vSumSQ, double *rSum, double *tSum, double *tfSum, double *qfSum, double *qstarSum, double *single_stats);
 
+// Particle Storage Functions
+size_t ParticleArrayStride(const size_t count);
+void ParticleArrayBind(ParticleArray *array, char *data, const size_t count);
+void *ParticleArrayComponent(const ParticleArray *array, const int component);
+size_t ParticleComponentSize(const int component);
+
+// Vertical Grid Functions
+LevelLocator LevelLocatorBuild(const double *levels, const int count);
+int LevelLocate(const LevelLocator locator, const double *levels, const int count, const double position);
+double *LagrangeDenominatorsBuild(const double *levels, const int count);
+LevelStencil *LevelStencilsBuild(const int count, const int wLevels);
+void ParticleArrayGet(const ParticleArray *array, const int index, Particle *output);
+void ParticleArraySet(ParticleArray *array, const int index, const Particle *input);
+
+// Field Storage Functions
+enum { FIELD_PLANAR = 0, FIELD_INTERLEAVED = 1, FIELD_BRICKED = 2 };
+const int FieldBrick = 4;
+size_t FieldArrayCapacity(const int nx, const int ny, const int nz);
+void FieldArrayBind(fieldSize *data, const size_t capacity, fieldSize **u, fieldSize **v, fieldSize **w, fieldSize **t, fieldSize **q);
+
+// Statistics Functions. Each z level holds StatisticsFields sums indexed by
+// the STAT_ offsets.
+enum { STAT_COUNT = 0, STAT_VP = 1, STAT_VPSQ = 4, STAT_RADIUS = 7, STAT_TP = 8, STAT_TF = 9, STAT_QF = 10, STAT_QSTAR = 11, StatisticsFields = 12 };
+void ParticleSampleStatistics(GPU *gpu, const int position, double *sample);
+
+// Host Update Kernels
+enum { SIMD_SCALAR = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
+StepConstants StepConstantsBuild(const Parameters *params, const double dt);
+int ParticleSIMDSupport();
+void UpdateParticlesAVX2(const StepConstants *constants, const int it, const int istage, const int start, const int end, ParticleArray particles);
+void UpdateParticlesAVX512(const StepConstants *constants, const int it, const int istage, const int start, const int end, ParticleArray particles);
+
+// Host Interpolation Kernels. Weights are evaluated for batches of up to
+// InterpolationBatch particles stored as [axis * 6 + node][lane].
+const int InterpolationBatch = 8;
+void LagrangeWeights(const double *offset, const double *inverse, double *weights);
+void LagrangeWeightsAVX2(const int count, const double *offset, const double *inverse, double *weights);
+void LagrangeWeightsAVX512(const int count, const double *offset, const double *inverse, double *weights);
+
+// Random Number Functions
+double ParticleRandom(const unsigned int seed, const unsigned int pidx, const unsigned int stream, const unsigned int draw);
+void ParticlePhilox4x32(const unsigned int *counter, const unsigned int *key, unsigned int *result);
+
 // Helper Functions
 const std::vector<double> ReadDoubleArray(const std::string &path);
 void WriteDoubleArray(const std::string &path, const std::vector<double> &array);
@@ -0,0 +1,58 @@
+#include "particle_simd.h"
+
+#include <immintrin.h>
+
+// Four doubles in one AVX2 register
+struct AVX2Vector {
+	static const int Width = 4;
+	__m256d v;
+
+	static AVX2Vector Make(const __m256d value) {
+		AVX2Vector retVal;
+		retVal.v = value;
+		return retVal;
+	}
+
+	static AVX2Vector Load(const double *data) { return Make(_mm256_loadu_pd(data)); }
+	static void Store(double *data, const AVX2Vector value) { _mm256_storeu_pd(data, value.v); }
+	static AVX2Vector Set(const double value) { return Make(_mm256_set1_pd(value)); }
+
+	static AVX2Vector Sqrt(const AVX2Vector a) { return Make(_mm256_sqrt_pd(a.v)); }
+	static AVX2Vector Min(const AVX2Vector a, const AVX2Vector b) { return Make(_mm256_min_pd(a.v, b.v)); }
+	static AVX2Vector Max(const AVX2Vector a, const AVX2Vector b) { return Make(_mm256_max_pd(a.v, b.v)); }
+	static AVX2Vector Round(const AVX2Vector a) { return Make(_mm256_round_pd(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)); }
+
+	static AVX2Vector SelectGreater(const AVX2Vector a, const AVX2Vector b, const AVX2Vector x, const AVX2Vector y) {
+		return Make(_mm256_blendv_pd(y.v, x.v, _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ)));
+	}
+
+	// Integral n in [-1022, 1023] placed directly into the exponent field
+	static AVX2Vector Pow2(const AVX2Vector n) {
+		const __m256d biased = _mm256_add_pd(n.v, _mm256_set1_pd(6755399441055744.0 + 1023.0));
+		return Make(_mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(biased), 52)));
+	}
+
+	static AVX2Vector Exponent(const AVX2Vector x) {
+		const __m256i bits = _mm256_srli_epi64(_mm256_castpd_si256(x.v), 52);
+		const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+		return Make(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(bits, _mm256_castpd_si256(magic))), magic));
+	}
+
+	static AVX2Vector Mantissa(const AVX2Vector x) {
+		const __m256i bits = _mm256_and_si256(_mm256_castpd_si256(x.v), _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL));
+		return Make(_mm256_castsi256_pd(_mm256_or_si256(bits, _mm256_set1_epi64x(0x3FF0000000000000LL))));
+	}
+};
+
+inline AVX2Vector operator+(const AVX2Vector a, const AVX2Vector b) { return AVX2Vector::Make(_mm256_add_pd(a.v, b.v)); }
+inline AVX2Vector operator-(const AVX2Vector a, const AVX2Vector b) { return AVX2Vector::Make(_mm256_sub_pd(a.v, b.v)); }
+inline AVX2Vector operator*(const AVX2Vector a, const AVX2Vector b) { return AVX2Vector::Make(_mm256_mul_pd(a.v, b.v)); }
+inline AVX2Vector operator/(const AVX2Vector a, const AVX2Vector b) { return AVX2Vector::Make(_mm256_div_pd(a.v, b.v)); }
+
+void UpdateParticlesAVX2(const StepConstants *constants, const int it, const int istage, const int start, const int end, ParticleArray particles) {
+	SIMDUpdateParticles<AVX2Vector>(constants, it, istage, start, end, particles);
+}
+
+void LagrangeWeightsAVX2(const int count, const double *offset, const double *inverse, double *weights) {
+	SIMDLagrangeWeights<AVX2Vector>(count, offset, inverse, weights);
+}
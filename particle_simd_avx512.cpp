@@ -0,0 +1,58 @@
+#include "particle_simd.h"
+
+#include <immintrin.h>
+
+// Eight doubles in one AVX-512 register
+struct AVX512Vector {
+	static const int Width = 8;
+	__m512d v;
+
+	static AVX512Vector Make(const __m512d value) {
+		AVX512Vector retVal;
+		retVal.v = value;
+		return retVal;
+	}
+
+	static AVX512Vector Load(const double *data) { return Make(_mm512_loadu_pd(data)); }
+	static void Store(double *data, const AVX512Vector value) { _mm512_storeu_pd(data, value.v); }
+	static AVX512Vector Set(const double value) { return Make(_mm512_set1_pd(value)); }
+
+	static AVX512Vector Sqrt(const AVX512Vector a) { return Make(_mm512_sqrt_pd(a.v)); }
+	static AVX512Vector Min(const AVX512Vector a, const AVX512Vector b) { return Make(_mm512_min_pd(a.v, b.v)); }
+	static AVX512Vector Max(const AVX512Vector a, const AVX512Vector b) { return Make(_mm512_max_pd(a.v, b.v)); }
+	static AVX512Vector Round(const AVX512Vector a) { return Make(_mm512_roundscale_pd(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)); }
+
+	static AVX512Vector SelectGreater(const AVX512Vector a, const AVX512Vector b, const AVX512Vector x, const AVX512Vector y) {
+		return Make(_mm512_mask_blend_pd(_mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ), y.v, x.v));
+	}
+
+	// Integral n in [-1022, 1023] placed directly into the exponent field
+	static AVX512Vector Pow2(const AVX512Vector n) {
+		const __m512d biased = _mm512_add_pd(n.v, _mm512_set1_pd(6755399441055744.0 + 1023.0));
+		return Make(_mm512_castsi512_pd(_mm512_slli_epi64(_mm512_castpd_si512(biased), 52)));
+	}
+
+	static AVX512Vector Exponent(const AVX512Vector x) {
+		const __m512i bits = _mm512_srli_epi64(_mm512_castpd_si512(x.v), 52);
+		const __m512d magic = _mm512_set1_pd(4503599627370496.0);
+		return Make(_mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(bits, _mm512_castpd_si512(magic))), magic));
+	}
+
+	static AVX512Vector Mantissa(const AVX512Vector x) {
+		const __m512i bits = _mm512_and_si512(_mm512_castpd_si512(x.v), _mm512_set1_epi64(0x000FFFFFFFFFFFFFLL));
+		return Make(_mm512_castsi512_pd(_mm512_or_si512(bits, _mm512_set1_epi64(0x3FF0000000000000LL))));
+	}
+};
+
+inline AVX512Vector operator+(const AVX512Vector a, const AVX512Vector b) { return AVX512Vector::Make(_mm512_add_pd(a.v, b.v)); }
+inline AVX512Vector operator-(const AVX512Vector a, const AVX512Vector b) { return AVX512Vector::Make(_mm512_sub_pd(a.v, b.v)); }
+inline AVX512Vector operator*(const AVX512Vector a, const AVX512Vector b) { return AVX512Vector::Make(_mm512_mul_pd(a.v, b.v)); }
+inline AVX512Vector operator/(const AVX512Vector a, const AVX512Vector b) { return AVX512Vector::Make(_mm512_div_pd(a.v, b.v)); }
+
+void UpdateParticlesAVX512(const StepConstants *constants, const int it, const int istage, const int start, const int end, ParticleArray particles) {
+	SIMDUpdateParticles<AVX512Vector>(constants, it, istage, start, end, particles);
+}
+
+void LagrangeWeightsAVX512(const int count, const double *offset, const double *inverse, double *weights) {
+	SIMDLagrangeWeights<AVX512Vector>(count, offset, inverse, weights);
+}